@@ -163,6 +163,10 @@ ${ffmpeg_dir}/libavformat/cavsvideodec_insert.sh # add CAVS_PROFILE_GUANDIAN to
 popd
 
 cp ${src_path}/src/libavcodec/* ${ffmpeg_dir}/libavcodec/
+# 3.0 has no libavcodec/tests
+if [ -d ${ffmpeg_dir}/libavcodec/tests ]; then
+    cp ${src_path}/src/libavcodec/tests/* ${ffmpeg_dir}/libavcodec/tests/
+fi
 pushd ${ffmpeg_dir}/libavcodec
 echo "add codec to allcodecs.c"
 ${ffmpeg_dir}/libavcodec/avcodec_insert.sh # add codec to allcodecs.c
@@ -6,15 +6,26 @@
 // Atomic type definitions
 #define atomic_int int
 #define atomic_uint unsigned int
+#define atomic_ullong unsigned long long
 #define atomic_uint_fast unsigned int
 #define atomic_uintptr_t unsigned long
 #define atomic_uintptr_fast unsigned long
 #define atomic_size_t size_t
 #define atomic_ptrdiff_t ptrdiff_t
 
-// Basic atomic operations
-#define atomic_store(ptr, val) (*(ptr) = (val))
-#define atomic_load(ptr) (*(ptr))
+// Basic atomic operations, full barrier on both sides so that they are seq_cst
+#define atomic_store(ptr, val)                         \
+    do {                                               \
+        __sync_synchronize();                          \
+        *(volatile __typeof__(*(ptr))*)(ptr) = (val);  \
+        __sync_synchronize();                          \
+    } while (0)
+#define atomic_load(ptr)                                               \
+    ({                                                                 \
+        __typeof__(*(ptr)) __v = *(volatile __typeof__(*(ptr))*)(ptr); \
+        __sync_synchronize();                                          \
+        __v;                                                           \
+    })
 
 // Atomic arithmetic operations
 #define atomic_fetch_add(ptr, val) __sync_fetch_and_add(ptr, val)
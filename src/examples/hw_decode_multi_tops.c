@@ -45,6 +45,7 @@
 #include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef void (*ffmpeg_log_callback)(void* ptr, int level, const char* fmt, va_list vl);
@@ -55,6 +56,7 @@ typedef void (*ffmpeg_log_callback)(void* ptr, int level, const char* fmt, va_li
 #define MAX_DEV_ID (8)
 #define MAX_SESSIONS (64)
 #define MAX_PATH_LEN (256 * 2)
+#define MAX_IN_FLIGHT (64) /* packets whose send time is kept for the frame latency */
 #define DEVICE_NAME "topscodec"
 static char            logBufPrefix[LOG_BUF_PREFIX_SIZE] = {0};
 static char            logBuffer[LOG_BUF_SIZE]           = {0};
@@ -67,6 +69,7 @@ typedef struct {
     int             released;
 } pseudo_barrier_t;
 
+static pseudo_barrier_t g_barrier_open;
 static pseudo_barrier_t g_barrier_start;
 static pseudo_barrier_t g_barrier_frame;
 static pseudo_barrier_t g_barrier_end;
@@ -98,10 +101,12 @@ static void pseudo_barrier_destroy(pseudo_barrier_t* b) {
     b->released = 0;
 }
 
-typedef enum Sync_type { SYNC_START, SYNC_FRAME, SYNC_END } Sync_type;
+typedef enum Sync_type { SYNC_OPEN, SYNC_START, SYNC_FRAME, SYNC_END } Sync_type;
 
 static const char* Sync_type2str(Sync_type type) {
     switch (type) {
+        case SYNC_OPEN:
+            return "SYNC_OPEN";
         case SYNC_START:
             return "SYNC_START";
         case SYNC_FRAME:
@@ -115,7 +120,9 @@ static const char* Sync_type2str(Sync_type type) {
 
 static void synchoronize(Sync_type type) {
     av_log(NULL, AV_LOG_DEBUG, "synchoronize:%s\n", Sync_type2str(type));
-    if (type == SYNC_START)
+    if (type == SYNC_OPEN)
+        pseudo_barrier_wait(&g_barrier_open);
+    else if (type == SYNC_START)
         pseudo_barrier_wait(&g_barrier_start);
     else if (type == SYNC_FRAME)
         pseudo_barrier_wait(&g_barrier_frame);
@@ -139,6 +146,19 @@ typedef struct job_args {
     uint64_t    start_time;
     uint64_t    end_time;
     uint64_t    latency;
+    uint64_t    cpu_time;  /* us, cpu consumed by the session thread */
+    uint64_t    wall_time; /* us, wall clock of the session decode loop */
+    uint64_t    open_start; /* us, when avcodec_open2() was called */
+    uint64_t    open_time;  /* us, avcodec_open2(), all sessions open at once when synchronized */
+    int64_t     send_pts[MAX_IN_FLIGHT];
+    uint64_t    send_time[MAX_IN_FLIGHT];
+    int         send_idx;
+    uint64_t    frame_latency_sum; /* us, send_packet to receive_frame of the same pts */
+    uint64_t    frame_latency_max;
+    int         frame_latency_nb;
+    int         seeks;
+    uint64_t    seek_flush_time;       /* us, sum of avcodec_flush_buffers() */
+    uint64_t    seek_first_frame_time; /* us, sum of flush to first frame after the seek */
     char        out_file[MAX_PATH_LEN];
     char        job_name[MAX_PATH_LEN];
     const char* in_file;
@@ -162,6 +182,11 @@ static int g_is_av1       = 0;
 static int g_zero_copy    = 1;
 static int g_sync         = 1;
 static int g_cb           = 0;
+static int g_wait_mode    = 0;
+static int g_seek_num     = 0;
+static int g_coalesce     = 0;
+static int g_recv_timeout = 0;
+static int g_output_order = 0;
 
 static const char* g_in_file  = NULL;
 static const char* g_out_file = NULL;
@@ -186,6 +211,17 @@ static void print_globle_var(void) {
     printf("g_zero_copy:%d\n", g_zero_copy);
     printf("g_sync:%d\n", g_sync);
     printf("g_callback:%d\n", g_cb);
+    printf("g_wait_mode:%d\n", g_wait_mode);
+    printf("g_seek_num:%d\n", g_seek_num);
+    printf("g_coalesce:%d\n", g_coalesce);
+    printf("g_recv_timeout:%d\n", g_recv_timeout);
+    printf("g_output_order:%d\n", g_output_order);
+}
+
+static uint64_t get_cpu_time_us(clockid_t clk_id) {
+    struct timespec ts;
+    if (clock_gettime(clk_id, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static int end_with(const char* str, const char* suffix) {
@@ -290,6 +326,11 @@ static int decode_write(job_args_t* job, FILE* outfile, AVCodecContext* avctx, A
     ptrdiff_t linesizes1[4] = {0};
     size_t    planesizes[4] = {0};
 
+    if (packet->size > 0 && packet->pts != AV_NOPTS_VALUE) {
+        job->send_pts[job->send_idx]  = packet->pts;
+        job->send_time[job->send_idx] = av_gettime();
+        job->send_idx                 = (job->send_idx + 1) % MAX_IN_FLIGHT;
+    }
     ret = avcodec_send_packet(avctx, packet);
     if (ret < 0) {
         av_log(avctx, AV_LOG_ERROR, "Error during avcodec_send_packet.\n");
@@ -327,6 +368,17 @@ static int decode_write(job_args_t* job, FILE* outfile, AVCodecContext* avctx, A
             goto fail;
         }
 
+        for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+            if (job->send_time[i] && job->send_pts[i] == frame->pts) {
+                uint64_t latency = av_gettime() - job->send_time[i];
+                job->frame_latency_sum += latency;
+                job->frame_latency_nb++;
+                if (latency > job->frame_latency_max) job->frame_latency_max = latency;
+                job->send_time[i] = 0;
+                break;
+            }
+        }
+
         job->frames++;
         if (job->frames == g_skip_frames) {
             if (g_sync) synchoronize(SYNC_FRAME);
@@ -411,6 +463,50 @@ static int decode_write(job_args_t* job, FILE* outfile, AVCodecContext* avctx, A
     return 0;
 }
 
+/*
+ * Seek back to the start g_seek_num times, timing the decoder flush and the
+ * first frame after it. Every round ends with an EOS drain so each seek starts
+ * from the same decoder state.
+ */
+static int seek_bench(job_args_t* job, AVFormatContext* input_ctx, AVCodecContext* avctx, int video_stream) {
+    AVPacket packet;
+    uint64_t flush_start = 0;
+    uint64_t flush_end   = 0;
+    int      frames      = 0;
+    int      ret         = 0;
+
+    job->seeks                 = 0;
+    job->seek_flush_time       = 0;
+    job->seek_first_frame_time = 0;
+    for (int i = 0; i < g_seek_num; i++) {
+        ret = av_seek_frame(input_ctx, video_stream, 0, AVSEEK_FLAG_BACKWARD);
+        if (ret < 0) {
+            av_log(avctx, AV_LOG_ERROR, "av_seek_frame failed, ret=%d\n", ret);
+            return ret;
+        }
+        flush_start = av_gettime();
+        avcodec_flush_buffers(avctx);
+        flush_end = av_gettime();
+
+        frames = job->frames;
+        while (job->frames == frames) {
+            if ((ret = av_read_frame(input_ctx, &packet)) < 0) break;
+            if (video_stream == packet.stream_index) ret = decode_write(job, NULL, avctx, &packet, 0);
+            av_packet_unref(&packet);
+            if (ret < 0) return ret;
+        }
+        job->seek_flush_time += flush_end - flush_start;
+        job->seek_first_frame_time += av_gettime() - flush_end;
+
+        packet.data = NULL;
+        packet.size = 0;
+        ret         = decode_write(job, NULL, avctx, &packet, 1);
+        if (ret < 0) return ret;
+        job->seeks++;
+    }
+    return 0;
+}
+
 static void log_callback_null(void* ptr, int level, const char* fmt, va_list vl) {
     pthread_mutex_lock(&cb_av_log_lock);
     snprintf(logBufPrefix, LOG_BUF_PREFIX_SIZE, "%s", fmt);
@@ -434,6 +530,7 @@ static void* job_thread(void* arg) {
     uint64_t start_time  = 0;
     uint64_t end_time    = 0;
     uint64_t elapsed     = 0;
+    uint64_t cpu_start   = 0;
 
     int video_stream = 0;
     int skip         = 0;
@@ -534,6 +631,22 @@ static void* job_thread(void* arg) {
     snprintf(tmp, sizeof(tmp), "%d", g_zero_copy);
     av_dict_set(&dec_opts, "zero_copy", tmp, 0);
 
+    memset(tmp, 0, sizeof(tmp));
+    snprintf(tmp, sizeof(tmp), "%d", g_wait_mode);
+    av_dict_set(&dec_opts, "wait_mode", tmp, 0);
+
+    memset(tmp, 0, sizeof(tmp));
+    snprintf(tmp, sizeof(tmp), "%d", g_coalesce);
+    av_dict_set(&dec_opts, "coalesce_bytes", tmp, 0);
+
+    memset(tmp, 0, sizeof(tmp));
+    snprintf(tmp, sizeof(tmp), "%d", g_recv_timeout);
+    av_dict_set(&dec_opts, "recv_timeout", tmp, 0);
+
+    memset(tmp, 0, sizeof(tmp));
+    snprintf(tmp, sizeof(tmp), "%d", g_output_order);
+    av_dict_set(&dec_opts, "output_order", tmp, 0);
+
     // case some video format can't detect w/h by avformat_find_stream_info
     // so we need to set the video w/h by user
     // expecially for the avs2
@@ -548,10 +661,13 @@ static void* job_thread(void* arg) {
         av_log(avctx, AV_LOG_DEBUG, "set in w/h:%d/%d\n", g_input_w, g_input_h);
     }
 
+    if (g_sync) synchoronize(SYNC_OPEN);
+    job->open_start = av_gettime();
     if ((ret = avcodec_open2(avctx, decoder, &dec_opts)) < 0) {
         fprintf(stderr, "Failed to open codec for stream #%d\n", video_stream);
         return NULL;
     }
+    job->open_time = av_gettime() - job->open_start;
     av_dict_free(&dec_opts);
 
     if (!avctx->hw_frames_ctx) {
@@ -576,6 +692,7 @@ static void* job_thread(void* arg) {
     job->first_read_frames = 0;
     job->start_time        = 0;
     start_time             = av_gettime();
+    cpu_start              = get_cpu_time_us(CLOCK_THREAD_CPUTIME_ID);
     while (ret >= 0) {
         if ((ret = av_read_frame(input_ctx, &packet)) < 0) break;
 
@@ -598,7 +715,9 @@ static void* job_thread(void* arg) {
         fprintf(stderr, "Error while flushing the decoder\n");
     }
     av_packet_unref(&packet);
-    end_time = av_gettime();
+    end_time       = av_gettime();
+    job->cpu_time  = get_cpu_time_us(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    job->wall_time = end_time - start_time;
 
     if (job->start_time == 0) {
         job->start_time = start_time;
@@ -617,6 +736,13 @@ static void* job_thread(void* arg) {
         job->latency = job->start_time - start_time;
     }
 
+    if (g_seek_num > 0) {
+        ret = seek_bench(job, input_ctx, avctx, video_stream);
+        if (ret < 0) {
+            fprintf(stderr, "seek bench failed after %d seeks\n", job->seeks);
+        }
+    }
+
     if (g_dump_out && output_file) {
         fclose(output_file);
     }
@@ -686,7 +812,7 @@ static int cal_card_dev_session() {
 static int parse_opt(int argc, char** argv) {
     int result;
 
-    while ((result = getopt(argc, argv, "a:e:g:c:n:d:m:s:i:o:y:l:k:f:b:p:z:w:h:")) != -1) {
+    while ((result = getopt(argc, argv, "a:e:g:c:n:d:m:s:i:o:y:l:k:f:b:p:z:w:h:x:r:u:t:q:")) != -1) {
         switch (result) {
             case 'a':
                 printf("option=h, optopt=%c, optarg=%s\n", optopt, optarg);
@@ -698,6 +824,31 @@ static int parse_opt(int argc, char** argv) {
                 g_cb = atoi(optarg);
                 printf("g_callback:%d\n", g_cb);
                 break;
+            case 'x':
+                printf("option=x, optopt=%c, optarg=%s\n", optopt, optarg);
+                g_wait_mode = atoi(optarg);
+                printf("g_wait_mode:%d\n", g_wait_mode);
+                break;
+            case 'r':
+                printf("option=r, optopt=%c, optarg=%s\n", optopt, optarg);
+                g_seek_num = atoi(optarg);
+                printf("g_seek_num:%d\n", g_seek_num);
+                break;
+            case 'u':
+                printf("option=u, optopt=%c, optarg=%s\n", optopt, optarg);
+                g_coalesce = atoi(optarg);
+                printf("g_coalesce:%d\n", g_coalesce);
+                break;
+            case 't':
+                printf("option=t, optopt=%c, optarg=%s\n", optopt, optarg);
+                g_recv_timeout = atoi(optarg);
+                printf("g_recv_timeout:%d\n", g_recv_timeout);
+                break;
+            case 'q':
+                printf("option=q, optopt=%c, optarg=%s\n", optopt, optarg);
+                g_output_order = atoi(optarg);
+                printf("g_output_order:%d\n", g_output_order);
+                break;
             case 'e':
                 printf("option=h, optopt=%c, optarg=%s\n", optopt, optarg);
                 g_sync = atoi(optarg);
@@ -822,6 +973,16 @@ int main(int argc, char* argv[]) {
     float    diff               = 0.0;
     float    variance           = 0.0;
     float    standard_deviation = 0.0;
+    float    cpu_usage          = 0.0;
+    float    sum_cpu_usage      = 0.0;
+    uint64_t proc_cpu_start     = 0;
+    uint64_t proc_cpu_time      = 0;
+    uint64_t proc_wall_start    = 0;
+    uint64_t proc_wall_time     = 0;
+    uint64_t sum_open_time      = 0;
+    uint64_t max_open_time      = 0;
+    uint64_t first_open_start   = 0;
+    uint64_t last_open_end      = 0;
 
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)
     /* register all formats and codecs */
@@ -834,6 +995,11 @@ int main(int argc, char* argv[]) {
             "Usage: %s [-a zero_copy 1/0] "
             "[-e sync 1/0] "
             "[-g callback 1/0] "
+            "[-x wait_mode 0(poll)/1(event)] "
+            "[-r seek_num] "
+            "[-u coalesce_bytes] "
+            "[-t recv_timeout_ms] "
+            "[-q output_order 0(display)/1(decode)] "
             "[-k kill_self 0/1] "
             "[-l loglevel0/1/2] "
             "[-f switch_frame] "
@@ -928,9 +1094,12 @@ int main(int argc, char* argv[]) {
     }
     printf("TOPS_VISIBLE_DEVICE:%s\n", getenv("TOPS_VISIBLE_DEVICE"));
     int all_session = cal_card_dev_session();
+    pseudo_barrier_init(&g_barrier_open, all_session);
     pseudo_barrier_init(&g_barrier_start, all_session);
     pseudo_barrier_init(&g_barrier_end, all_session);
     pseudo_barrier_init(&g_barrier_frame, all_session);
+    proc_cpu_start  = get_cpu_time_us(CLOCK_PROCESS_CPUTIME_ID);
+    proc_wall_start = av_gettime();
     for (int i = g_card_start; i < g_card_end; i++) {
         for (int j = g_dev_start; j < g_dev_end; j++) {
             if (g_is_av1) {
@@ -940,7 +1109,8 @@ int main(int argc, char* argv[]) {
                 }
             }
             for (int k = 0; k < g_sessions; k++) {
-                jobs[i][j][k]               = (job_args_t*)malloc(sizeof(job_args_t));
+                jobs[i][j][k] = (job_args_t*)malloc(sizeof(job_args_t));
+                memset(jobs[i][j][k], 0, sizeof(job_args_t));
                 jobs[i][j][k]->card_id      = i;
                 jobs[i][j][k]->dev_id       = j;
                 jobs[i][j][k]->session_id   = k;
@@ -949,6 +1119,7 @@ int main(int argc, char* argv[]) {
                 jobs[i][j][k]->in_port_num  = g_in_port_num;
                 jobs[i][j][k]->out_port_num = g_out_port_num;
                 jobs[i][j][k]->callback     = g_cb;
+                jobs[i][j][k]->seeks        = 0;
                 threads[i][j][k]            = (pthread_t*)malloc(sizeof(pthread_t));
                 memset(name, 0, sizeof(name));
                 memset(g_out_file_copy1, 0, sizeof(g_out_file_copy1));
@@ -992,6 +1163,9 @@ int main(int argc, char* argv[]) {
             }
         }
     }
+    /* process time also covers the codec's own callback/worker threads */
+    proc_cpu_time  = get_cpu_time_us(CLOCK_PROCESS_CPUTIME_ID) - proc_cpu_start;
+    proc_wall_time = av_gettime() - proc_wall_start;
 
     /*print result msg*/
     for (int i = g_card_start; i < g_card_end; i++) {
@@ -1008,6 +1182,9 @@ int main(int argc, char* argv[]) {
             min_fps          = jobs[i][j][0]->fps;
             sum_skip_frames  = 0;
             mean_skip_frames = 0;
+            sum_cpu_usage    = 0.0;
+            sum_open_time    = 0;
+            max_open_time    = 0;
             for (int k = 0; k < g_sessions; k++) {
                 if (jobs[i][j][k]->fps > max_fps) {
                     max_fps = jobs[i][j][k]->fps;
@@ -1018,6 +1195,21 @@ int main(int argc, char* argv[]) {
                 sum_frames += jobs[i][j][k]->frames;
                 sum_fps += jobs[i][j][k]->fps;
                 sum_skip_frames += jobs[i][j][k]->first_read_frames;
+                cpu_usage = 0.0;
+                if (jobs[i][j][k]->wall_time > 0) {
+                    cpu_usage = 100.f * jobs[i][j][k]->cpu_time / jobs[i][j][k]->wall_time;
+                }
+                sum_cpu_usage += cpu_usage;
+                sum_open_time += jobs[i][j][k]->open_time;
+                if (jobs[i][j][k]->open_time > max_open_time) {
+                    max_open_time = jobs[i][j][k]->open_time;
+                }
+                if (first_open_start == 0 || jobs[i][j][k]->open_start < first_open_start) {
+                    first_open_start = jobs[i][j][k]->open_start;
+                }
+                if (jobs[i][j][k]->open_start + jobs[i][j][k]->open_time > last_open_end) {
+                    last_open_end = jobs[i][j][k]->open_start + jobs[i][j][k]->open_time;
+                }
                 av_log(NULL, AV_LOG_INFO,
                        "thread card:%2d, "
                        "dev:%2d, "
@@ -1025,9 +1217,35 @@ int main(int argc, char* argv[]) {
                        "frames:%5d, "
                        "skip_frames:%5lu, "
                        "fps:%5.2f, "
-                       "latency:%lu\n",
+                       "latency:%lu, "
+                       "open:%8.3fms, "
+                       "cpu:%6.2f%%\n",
                        i, j, k, jobs[i][j][k]->frames, jobs[i][j][k]->first_read_frames, jobs[i][j][k]->fps,
-                       jobs[i][j][k]->latency);
+                       jobs[i][j][k]->latency, jobs[i][j][k]->open_time / 1000.f, cpu_usage);
+                if (jobs[i][j][k]->frame_latency_nb > 0) {
+                    av_log(NULL, AV_LOG_INFO,
+                           "thread card:%2d, "
+                           "dev:%2d, "
+                           "session:%2d, "
+                           "output_order:%d, "
+                           "mean_frame_latency:%8.3fms, "
+                           "max_frame_latency:%8.3fms\n",
+                           i, j, k, g_output_order,
+                           jobs[i][j][k]->frame_latency_sum / 1000.f / jobs[i][j][k]->frame_latency_nb,
+                           jobs[i][j][k]->frame_latency_max / 1000.f);
+                }
+                if (jobs[i][j][k]->seeks > 0) {
+                    av_log(NULL, AV_LOG_INFO,
+                           "thread card:%2d, "
+                           "dev:%2d, "
+                           "session:%2d, "
+                           "seeks:%4d, "
+                           "mean_flush:%8.3fms, "
+                           "mean_first_frame:%8.3fms\n",
+                           i, j, k, jobs[i][j][k]->seeks,
+                           jobs[i][j][k]->seek_flush_time / 1000.f / jobs[i][j][k]->seeks,
+                           jobs[i][j][k]->seek_first_frame_time / 1000.f / jobs[i][j][k]->seeks);
+                }
             }
             mean_fps         = sum_fps / g_sessions;
             mean_skip_frames = sum_skip_frames / g_sessions;
@@ -1054,13 +1272,31 @@ int main(int argc, char* argv[]) {
                 "mean_latency:%5lu, "
                 "max_fps:%8.2f, "
                 "min_fps:%8.2f, "
-                "mean_fps:%8.2f\n",
+                "mean_fps:%8.2f, "
+                "mean_open:%8.3fms, "
+                "max_open:%8.3fms, "
+                "mean_cpu:%6.2f%%\n",
                 i, j, g_sessions, g_frame_sf, mean_skip_frames, standard_deviation, mean_latency, max_fps, min_fps,
-                mean_fps);
+                mean_fps, sum_open_time / 1000.f / g_sessions, max_open_time / 1000.f, sum_cpu_usage / g_sessions);
         }
     }
+    if (proc_wall_time > 0 && all_session > 0) {
+        printf(
+            "wait_mode:%d, "
+            "callback:%d, "
+            "nsession:%d, "
+            "process_cpu:%8.2f%%, "
+            "cpu_per_session:%6.2f%%\n",
+            g_wait_mode, g_cb, all_session, 100.f * proc_cpu_time / proc_wall_time,
+            100.f * proc_cpu_time / proc_wall_time / all_session);
+    }
+    if (last_open_end > first_open_start) {
+        /* from the first avcodec_open2() call to the last session being ready to decode */
+        printf("nsession:%d, all_sessions_ready:%8.3fms\n", all_session, (last_open_end - first_open_start) / 1000.f);
+    }
     av_log(NULL, AV_LOG_INFO, "main thread finish\n");
     pthread_mutex_destroy(&cb_av_log_lock);
+    pseudo_barrier_destroy(&g_barrier_open);
     pseudo_barrier_destroy(&g_barrier_start);
     pseudo_barrier_destroy(&g_barrier_end);
     pseudo_barrier_destroy(&g_barrier_frame);
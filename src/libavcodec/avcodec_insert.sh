@@ -133,4 +133,26 @@ M_BUF="OBJS-\$(CONFIG_TOPSCODEC)               += ff_topscodec_buffers.o\n"
 sed -E -i "/${M_END_SUB}/a \
 ${M_BUF} " ${M_FILE}
 
+# test programs and their fate targets, libavcodec/tests only exists since 3.2
+if [ -d tests ]; then
+  T_END="TESTPROGS\-\\\$\(CONFIG_CABAC\)"
+  T_RING="TESTPROGS-\$(CONFIG_TOPSCODEC)             += topscodec_ring\n"
+  T_POOL="TESTPROGS-\$(CONFIG_TOPSCODEC)             += topscodec_frame_pool\n"
+  sed -E -i "/${T_END}/i \
+${T_RING}${T_POOL}" ${M_FILE}
+
+  F_FILE="../tests/fate/libavcodec.mak"
+  F_END="^FATE\-\\\$\(CONFIG_AVCODEC\)"
+  F_RING="FATE_LIBAVCODEC-\$(CONFIG_TOPSCODEC) += fate-topscodec-ring\n\
+fate-topscodec-ring: libavcodec/tests/topscodec_ring\$(EXESUF)\n\
+fate-topscodec-ring: CMD = run libavcodec/tests/topscodec_ring\$(EXESUF)\n\
+fate-topscodec-ring: CMP = null\n"
+  F_POOL="FATE_LIBAVCODEC-\$(CONFIG_TOPSCODEC) += fate-topscodec-frame-pool\n\
+fate-topscodec-frame-pool: libavcodec/tests/topscodec_frame_pool\$(EXESUF)\n\
+fate-topscodec-frame-pool: CMD = run libavcodec/tests/topscodec_frame_pool\$(EXESUF)\n\
+fate-topscodec-frame-pool: CMP = null\n"
+  sed -E -i "/${F_END}/i \
+${F_RING}${F_POOL}" ${F_FILE}
+fi
+
 exit 0
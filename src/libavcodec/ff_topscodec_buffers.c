@@ -30,6 +30,7 @@
 #include "libavcodec/avcodec.h"
 #include "libavcodec/internal.h"
 #include "libavutil/avassert.h"
+#include "libavutil/hwcontext_topscodec.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/pixfmt.h"
@@ -188,20 +189,261 @@ topscodecPixelFormat_t avpixfmt_2_topspixfmt(enum AVPixelFormat fmt) {
     return TOPSCODEC_PIX_FMT_I420;
 }
 
-static void topscodec_free_buffer(void* opaque, uint8_t* unused) {
-    int                  ret;
-    EFBuffer*            efbuf = opaque;
-    EFCodecDecContext_t* ctx   = (EFCodecDecContext_t*)efbuf->ef_context;
+/******************************************************************************
+ *
+ *             SPSC frame ring
+ *
+ ******************************************************************************/
+
+int ff_topscodec_ring_init(EFFrameRing* ring, unsigned nb_slots) {
+    unsigned size = 1;
+
+    while (size < nb_slots) size <<= 1;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = av_mallocz_array(size, sizeof(AVFrame*));
+    if (!ring->slots) return AVERROR(ENOMEM);
+
+    for (unsigned i = 0; i < size; i++) {
+        ring->slots[i] = av_frame_alloc();
+        if (!ring->slots[i]) {
+            ring->size = size;
+            ff_topscodec_ring_uninit(ring);
+            return AVERROR(ENOMEM);
+        }
+    }
+    ring->size = size;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void ff_topscodec_ring_reset(EFFrameRing* ring) {
+    if (!ring->slots) return;
+    for (unsigned i = 0; i < ring->size; i++) {
+        if (ring->slots[i]) av_frame_unref(ring->slots[i]);
+    }
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+}
+
+void ff_topscodec_ring_uninit(EFFrameRing* ring) {
+    if (!ring->slots) return;
+    for (unsigned i = 0; i < ring->size; i++) {
+        av_frame_free(&ring->slots[i]);
+    }
+    av_freep(&ring->slots);
+    ring->size = 0;
+    ring->mask = 0;
+}
+
+AVFrame* ff_topscodec_ring_write_slot(EFFrameRing* ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= ring->size) return NULL;
+    return ring->slots[head & ring->mask];
+}
+
+void ff_topscodec_ring_write_commit(EFFrameRing* ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+AVFrame* ff_topscodec_ring_read_slot(EFFrameRing* ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) return NULL;
+    return ring->slots[tail & ring->mask];
+}
+
+void ff_topscodec_ring_read_commit(EFFrameRing* ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+unsigned ff_topscodec_ring_count(EFFrameRing* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/******************************************************************************
+ *
+ *             AVFrame pool
+ *
+ ******************************************************************************/
+
+static int topscodec_frame_pool_grow(EFFramePool* pool, int size) {
+    AVFrame** frames = av_realloc_array(pool->frames, size, sizeof(AVFrame*));
+    if (!frames) return AVERROR(ENOMEM);
+    pool->frames = frames;
+    pool->size   = size;
+    return 0;
+}
+
+int ff_topscodec_frame_pool_init(EFFramePool* pool, int nb_frames) {
+    int ret = 0;
+
+    memset(pool, 0, sizeof(EFFramePool));
+    ret = topscodec_frame_pool_grow(pool, nb_frames);
+    if (ret < 0) return ret;
+
+    for (int i = 0; i < nb_frames; i++) {
+        pool->frames[i] = av_frame_alloc();
+        if (!pool->frames[i]) {
+            ff_topscodec_frame_pool_uninit(pool);
+            return AVERROR(ENOMEM);
+        }
+        pool->nb_frames++;
+        pool->nb_allocs++;
+    }
+    return 0;
+}
+
+void ff_topscodec_frame_pool_uninit(EFFramePool* pool) {
+    while (pool->nb_frames > 0) av_frame_free(&pool->frames[--pool->nb_frames]);
+    av_freep(&pool->frames);
+    pool->size = 0;
+}
+
+AVFrame* ff_topscodec_frame_pool_get(EFFramePool* pool) {
+    AVFrame* frame = NULL;
+
+    pool->nb_gets++;
+    if (pool->nb_frames > 0) return pool->frames[--pool->nb_frames];
+
+    /* keep room in the free list for every frame the pool owns */
+    if (topscodec_frame_pool_grow(pool, pool->size + 1) < 0) return NULL;
+    frame = av_frame_alloc();
+    if (!frame) {
+        pool->size--;
+        return NULL;
+    }
+    pool->nb_allocs++;
+    return frame;
+}
+
+void ff_topscodec_frame_pool_put(EFFramePool* pool, AVFrame* frame) {
+    if (!frame) return;
+    av_frame_unref(frame);
+    if (pool->nb_frames < pool->size)
+        pool->frames[pool->nb_frames++] = frame;
+    else
+        av_frame_free(&frame);
+}
+
+/******************************************************************************
+ *
+ *             Coalesced pts queue
+ *
+ ******************************************************************************/
+
+int ff_topscodec_pts_queue_push(EFPtsQueue* queue, int64_t pts, int64_t batch) {
+    EFPtsEntry* tmp = NULL;
+
+    if (queue->nb_pts == queue->size) {
+        tmp = av_realloc_array(queue->pts, FFMAX(2 * queue->size, 16), sizeof(*tmp));
+        if (!tmp) return AVERROR(ENOMEM);
+        queue->pts  = tmp;
+        queue->size = FFMAX(2 * queue->size, 16);
+    }
+
+    queue->pts[queue->nb_pts].pts   = pts;
+    queue->pts[queue->nb_pts].batch = batch;
+    queue->nb_pts++;
+    return 0;
+}
+
+static void pts_queue_remove(EFPtsQueue* queue, int i) {
+    queue->nb_pts--;
+    memmove(queue->pts + i, queue->pts + i + 1, (queue->nb_pts - i) * sizeof(*queue->pts));
+}
+
+int64_t ff_topscodec_pts_queue_pop(EFPtsQueue* queue, int64_t batch) {
+    int     in_batch = 0;
+    int     best     = -1;
+    int64_t pts;
+    int     i;
+
+    if (queue->nb_pts == 0) return AV_NOPTS_VALUE;
+    for (i = 0; i < queue->nb_pts && !in_batch; i++) in_batch = queue->pts[i].batch == batch;
+
+    /* a packet without pts keeps its place, it ends the search for the smallest pts */
+    for (i = 0; i < queue->nb_pts; i++) {
+        if (in_batch && queue->pts[i].batch != batch) continue;
+        if (queue->pts[i].pts == AV_NOPTS_VALUE) {
+            if (best < 0) best = i;
+            break;
+        }
+        if (best < 0 || queue->pts[i].pts < queue->pts[best].pts) best = i;
+    }
+    pts = queue->pts[best].pts;
+    pts_queue_remove(queue, best);
+    if (pts == AV_NOPTS_VALUE) return pts;
+
+    /* display order, nothing smaller comes out after this frame */
+    for (i = queue->nb_pts - 1; i >= 0; i--)
+        if (queue->pts[i].pts != AV_NOPTS_VALUE && queue->pts[i].pts < pts) pts_queue_remove(queue, i);
+    return pts;
+}
+
+void ff_topscodec_pts_queue_uninit(EFPtsQueue* queue) {
+    av_freep(&queue->pts);
+    queue->nb_pts = 0;
+    queue->size   = 0;
+}
+
+/******************************************************************************
+ *
+ *             EFBuffer slot pool
+ *
+ ******************************************************************************/
+
+EFBuffer* ff_topscodec_efbuf_get(AVBufferPool* pool, AVCodecContext* avctx, void* ef_context) {
+    AVBufferRef* ref   = NULL;
+    EFBuffer*    efbuf = NULL;
+
+    ref = av_buffer_pool_get(pool);
+    if (!ref) return NULL;
+
+    /* pool entries are recycled, clear what the previous frame left */
+    efbuf = (EFBuffer*)ref->data;
+    memset(efbuf, 0, sizeof(EFBuffer));
+    efbuf->slot_ref   = ref;
+    efbuf->avctx      = avctx;
+    efbuf->ef_context = ef_context;
+    atomic_init(&efbuf->context_refcount, 1);
+    return efbuf;
+}
+
+void ff_topscodec_efbuf_release(EFBuffer* efbuf) {
+    /* efbuf lives inside slot_ref, do not touch it after the unref */
+    AVBufferRef* ref = efbuf->slot_ref;
+
+    if (!ref) return;
+    if (efbuf->lib_release) efbuf->lib_release(&efbuf->lib);
+    efbuf->slot_ref = NULL;
+    av_buffer_unref(&ref);
+}
+
+/* may run after the decoder is closed, avctx and ef_context are gone by then */
+void ff_topscodec_efbuf_unref(EFBuffer* efbuf) {
+    int ret;
 
     if (atomic_fetch_sub(&efbuf->context_refcount, 1) == 1) {
-        ret = ctx->topscodec_lib_ctx->lib_topscodecDecFrameUnmap(ctx->handle, &efbuf->ef_frame);
+        ret = efbuf->lib->lib_topscodecDecFrameUnmap(efbuf->handle, &efbuf->ef_frame);
         if (ret != 0)
-            av_log(efbuf->avctx, AV_LOG_ERROR, "topscodecDecFrameUnmap FAILED.\n");
+            av_log(NULL, AV_LOG_ERROR, "topscodecDecFrameUnmap FAILED.\n");
         else
-            av_log(efbuf->avctx, AV_LOG_DEBUG, "topscodecDecFrameUnmap SUCCESS.\n");
+            av_log(NULL, AV_LOG_DEBUG, "topscodecDecFrameUnmap SUCCESS.\n");
+        ff_topscodec_efbuf_release(efbuf);
     }
 }
 
+static void topscodec_free_buffer(void* opaque, uint8_t* unused) { ff_topscodec_efbuf_unref(opaque); }
+
 static int topscodec_buf_increase_ref(EFBuffer* efbuf) {
     atomic_fetch_add(&efbuf->context_refcount, 1);
     return 0;
@@ -271,13 +513,50 @@ int ff_topscodec_avframe_to_efbuf(const AVFrame* avframe, EFBuffer* efbuf) {
     return 0;
 }
 
+/*
+ * The pool of a frames context is sized once, a frame of another size gets a
+ * new context on the same device. Frames already out keep a reference to the
+ * old one, which goes away with the last of them. In callback mode this runs
+ * on the codec thread, so only ctx->hwframe is replaced here, avctx follows on
+ * the thread that receives the frames.
+ */
+static int topscodec_frames_ctx_resize(AVCodecContext* avctx, int width, int height) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    AVHWFramesContext*   old = ctx->hwframes_ctx;
+    AVHWFramesContext*   hw_frame_ctx;
+    AVBufferRef*         ref;
+    int                  ret;
+
+    ref = av_hwframe_ctx_alloc(old->device_ref);
+    if (!ref) return AVERROR(ENOMEM);
+    hw_frame_ctx                    = (AVHWFramesContext*)ref->data;
+    hw_frame_ctx->format            = old->format;
+    hw_frame_ctx->sw_format         = old->sw_format;
+    hw_frame_ctx->width             = width;
+    hw_frame_ctx->height            = height;
+    hw_frame_ctx->initial_pool_size = old->initial_pool_size;
+    memcpy(hw_frame_ctx->hwctx, old->hwctx, sizeof(AVTOPSCodecFramesContext));
+    ret = av_hwframe_ctx_init(ref);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "av_hwframe_ctx_init for %dx%d failed, ret(%d)\n", width, height, ret);
+        av_buffer_unref(&ref);
+        return ret;
+    }
+    av_log(avctx, AV_LOG_VERBOSE, "geometry change %dx%d -> %dx%d, new hw frames context\n", old->width,
+           old->height, width, height);
+
+    av_buffer_unref(&ctx->hwframe);
+    ctx->hwframe      = ref;
+    ctx->hwframes_ctx = hw_frame_ctx;
+    return 0;
+}
+
 int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe) {
     int                    ret          = 0;
     AVCodecContext*        avctx        = NULL;
     EFCodecDecContext_t*   ctx          = NULL;
     AVHWFramesContext*     hw_frame_ctx = NULL;
     TopsRuntimesFunctions* topsruntime  = NULL;
-    TopsCodecFunctions*    topscodec    = NULL;
 
     int       linesizes[4]  = {0};
     ptrdiff_t linesizes1[4] = {0};
@@ -289,19 +568,17 @@ int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe) {
 
     avctx        = efbuf->avctx;
     ctx          = avctx->priv_data;
-    topscodec    = ctx->topscodec_lib_ctx;
     topsruntime  = ctx->topsruntime_lib_ctx;
-    hw_frame_ctx = (AVHWFramesContext*)avctx->hw_frames_ctx->data;
+    hw_frame_ctx = ctx->hwframes_ctx;
 
     avframe->height = efbuf->ef_frame.height;
     avframe->width  = efbuf->ef_frame.width;
 
-    /*reset w and h*/
-    hw_frame_ctx->height = efbuf->ef_frame.height;
-    hw_frame_ctx->width  = efbuf->ef_frame.width;
-    avctx->height        = efbuf->ef_frame.height;
-    avctx->width         = efbuf->ef_frame.width;
-    avframe->format      = topspixfmt_2_avpixfmt(efbuf->ef_frame.pixel_format);
+    if (hw_frame_ctx->width != avframe->width || hw_frame_ctx->height != avframe->height) {
+        ret = topscodec_frames_ctx_resize(avctx, avframe->width, avframe->height);
+        if (ret < 0) return ret;
+    }
+    avframe->format = topspixfmt_2_avpixfmt(efbuf->ef_frame.pixel_format);
 
     ret = av_image_fill_linesizes(linesizes, avframe->format, avframe->width);
     if (ret < 0) {
@@ -333,7 +610,7 @@ int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe) {
     /* 1. get references to the actual data */
     if (!ctx->zero_copy) { /*Not support yet*/
         // pthread_mutex_lock(&g_buf_mutex);
-        av_hwframe_get_buffer(avctx->hw_frames_ctx, avframe, 0);
+        av_hwframe_get_buffer(ctx->hwframe, avframe, 0);
         // pthread_mutex_unlock(&g_buf_mutex);
 
         for (int i = 0; i < efbuf->ef_frame.plane_num; i++) {
@@ -368,13 +645,7 @@ int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe) {
             }
             av_log(avctx, AV_LOG_DEBUG, "d2d: dev %p -> dev %p, size %lu\n", data[i], avframe->data[i], planesizes[i]);
         }  // for
-        ret = topscodec->lib_topscodecDecFrameUnmap(ctx->handle, &efbuf->ef_frame);
-        if (ret != 0) {
-            av_log(avctx, AV_LOG_ERROR, "topscodecDecFrameUnmap FAILED.\n");
-            av_frame_unref(avframe);
-            return AVERROR_BUG;
-        }
-        av_log(avctx, AV_LOG_DEBUG, "topscodecDecFrameUnmap SUCCESS.\n");
+        /* the copy is done, ef_frame is unmapped when the caller drops its reference */
     } else { /*zero copy*/
         for (int i = 0; i < efbuf->ef_frame.plane_num; i++) {
             ret = topscodec_buf_to_bufref(efbuf, i, &avframe->buf[i], planesizes[i]);
@@ -384,7 +655,7 @@ int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe) {
             avframe->data[i]     = avframe->buf[i]->data;
         }
         // 当zero_copy= 1的时候，av_hwframe_get_buffer会执行下面这条命令，所以这条指令务必在这个{}中。
-        avframe->hw_frames_ctx = av_buffer_ref(avctx->hw_frames_ctx);
+        avframe->hw_frames_ctx = av_buffer_ref(ctx->hwframe);
     }
 
     // if (avctx->pkt_timebase.num && avctx->pkt_timebase.den)
@@ -427,6 +698,38 @@ int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe) {
     return 0;
 }
 
+/*
+ * Zero copy view of a companion frame, the planes stay in device memory and
+ * the frame stays mapped until the last reference is dropped. No frames
+ * context is involved, unlike ff_topscodec_efbuf_to_avframe().
+ */
+int ff_topscodec_efbuf_to_companion(const EFBuffer* efbuf, AVFrame* avframe) {
+    int       ret;
+    ptrdiff_t linesizes[4]  = {0};
+    size_t    planesizes[4] = {0};
+
+    avframe->format = topspixfmt_2_avpixfmt(efbuf->ef_frame.pixel_format);
+    avframe->width  = efbuf->ef_frame.width;
+    avframe->height = efbuf->ef_frame.height;
+    if (av_pix_fmt_count_planes(avframe->format) != efbuf->ef_frame.plane_num) return AVERROR_BUG;
+
+    for (int i = 0; i < efbuf->ef_frame.plane_num; i++) linesizes[i] = efbuf->ef_frame.plane[i].stride;
+    ret = av_image_fill_plane_sizes(planesizes, avframe->format, avframe->height, linesizes);
+    if (ret < 0) return ret;
+
+    for (int i = 0; i < efbuf->ef_frame.plane_num; i++) {
+        ret = topscodec_buf_to_bufref(efbuf, i, &avframe->buf[i], planesizes[i]);
+        if (ret) return ret;
+
+        avframe->linesize[i] = efbuf->ef_frame.plane[i].stride;
+        avframe->data[i]     = avframe->buf[i]->data;
+    }
+    avframe->pict_type = tops_2_av_pic_type(efbuf->ef_frame.pic_type);
+    avframe->key_frame = key_frame(efbuf->ef_frame.pic_type);
+    avframe->pts       = efbuf->ef_frame.pts;
+    return 0;
+}
+
 int ff_topscodec_efbuf_to_avpkt(const EFBuffer* efbuf, AVPacket* avpkt) {
     AVCodecContext* avctx = efbuf->avctx;
     av_assert0(avpkt);
@@ -505,3 +808,46 @@ int ff_topscodec_avpkt_to_efbuf(const AVPacket* avpkt, EFBuffer* efbuf) {
 
     return 0;
 }
+
+int ff_topscodec_avpkt_append_efbuf(const AVPacket* avpkt, EFBuffer* efbuf) {
+    uint8_t*               data         = NULL;
+    topscodecStream_t*     efpkt        = NULL;
+    AVCodecContext*        avctx        = NULL;
+    EFCodecDecContext_t*   ctx          = NULL;
+    TopsRuntimesFunctions* topsruntimes = NULL;
+
+    topsError_t tops_ret;
+
+    av_assert0(avpkt);
+    av_assert0(efbuf);
+
+    efpkt        = &efbuf->ef_pkt;
+    avctx        = efbuf->avctx;
+    ctx          = avctx->priv_data;
+    topsruntimes = ctx->topsruntime_lib_ctx;
+
+    if (avpkt->size <= 0 || !avpkt->data) return 0;
+    if (efpkt->data_len + avpkt->size > ctx->stream_buf_size) {
+        av_log(avctx, AV_LOG_ERROR, "stream buffer full, %u + %d > %u\n", efpkt->data_len, avpkt->size,
+               ctx->stream_buf_size);
+        return AVERROR(ENOSPC);
+    }
+
+    data = (uint8_t*)ctx->stream_addr + efpkt->data_len;
+    if (avpkt->size < 512) {
+        memcpy(data, avpkt->data, avpkt->size);
+    } else {
+        tops_ret = topsruntimes->lib_topsMemcpyHtoD(data, avpkt->data, avpkt->size);
+        if (tops_ret != topsSuccess) {
+            av_log(avctx, AV_LOG_ERROR, "topsMemcpyHtoD failed!\n");
+            return AVERROR(EPERM);
+        }
+        av_log(avctx, AV_LOG_DEBUG, "h2d(topsMemcpyHtoD): host %p -> dev %p, size %d \n", avpkt->data, data,
+               avpkt->size);
+    }
+    efpkt->data_len += avpkt->size;
+
+    if (avpkt->flags & AV_PKT_FLAG_KEY) efpkt->stream_type = TOPSCODEC_NALU_TYPE_I;
+
+    return 0;
+}
@@ -45,6 +45,17 @@ typedef struct {
      * of how many context-refs we are holding. */
     AVBufferRef* context_ref;
     atomic_uint  context_refcount;
+    /* pool entry backing this EFBuffer, NULL if it was not taken from a pool */
+    AVBufferRef* slot_ref;
+    /* handle ef_frame was mapped from, the unmap goes to it */
+    topscodecHandle_t handle;
+    /*
+     * library for the unmap, a reference of its own as the caller may hold
+     * the frame past the decoder's close. lib_release drops it, NULL if the
+     * EFBuffer holds none.
+     */
+    TopsCodecFunctions* lib;
+    void (*lib_release)(TopsCodecFunctions** lib);
 
     AVPacket* av_pkt;
     /* Reference to a frame. Only used during encoding */
@@ -65,6 +76,142 @@ typedef struct {
     topscodecStream_t ef_pkt;
 } EFBuffer;
 
+/*
+ * Fixed-capacity single-producer/single-consumer ring of preallocated frames.
+ * The producer (decode_callback on the codec thread, or the send loop in sync
+ * mode) fills the slot returned by ff_topscodec_ring_write_slot() and
+ * publishes it with ff_topscodec_ring_write_commit(); the consumer takes it
+ * with ff_topscodec_ring_read_slot()/ff_topscodec_ring_read_commit().
+ * head is only written by the producer and tail only by the consumer, the
+ * release store on one side pairs with the acquire load on the other.
+ */
+typedef struct {
+    AVFrame**   slots;
+    unsigned    size; /* power of two */
+    unsigned    mask;
+    atomic_uint head; /* next slot to write */
+    atomic_uint tail; /* next slot to read */
+} EFFrameRing;
+
+/**
+ * Allocate the ring and all its frame slots
+ *
+ * @param[out] ring ring to initialize
+ * @param[in] nb_slots minimum capacity, rounded up to a power of two
+ *
+ * @returns 0 in case of success, AVERROR(ENOMEM) otherwise
+ */
+int ff_topscodec_ring_init(EFFrameRing* ring, unsigned nb_slots);
+
+/**
+ * Unref the frames still queued and free the slots. Neither side may be
+ * active at this point.
+ */
+void ff_topscodec_ring_uninit(EFFrameRing* ring);
+
+/**
+ * Drop the frames still queued. Neither side may be active at this point.
+ */
+void ff_topscodec_ring_reset(EFFrameRing* ring);
+
+/* producer side, returns NULL when the ring is full */
+AVFrame* ff_topscodec_ring_write_slot(EFFrameRing* ring);
+void     ff_topscodec_ring_write_commit(EFFrameRing* ring);
+
+/* consumer side, returns NULL when the ring is empty */
+AVFrame* ff_topscodec_ring_read_slot(EFFrameRing* ring);
+void     ff_topscodec_ring_read_commit(EFFrameRing* ring);
+
+/* number of queued frames, exact only when called from either side */
+unsigned ff_topscodec_ring_count(EFFrameRing* ring);
+
+/*
+ * Recycled AVFrame shells for the prop and flush fifos, so the steady state
+ * does not go through av_frame_alloc()/av_frame_free(). Only used from the
+ * caller's decoding thread, there is no locking.
+ */
+typedef struct {
+    AVFrame** frames;    /* free list */
+    int       nb_frames; /* frames in the free list */
+    int       size;      /* frames owned by the pool, free list capacity */
+    unsigned  nb_gets;
+    unsigned  nb_allocs; /* av_frame_alloc() calls, == size */
+} EFFramePool;
+
+/**
+ * Preallocate nb_frames frames
+ *
+ * @returns 0 in case of success, AVERROR(ENOMEM) otherwise
+ */
+int ff_topscodec_frame_pool_init(EFFramePool* pool, int nb_frames);
+
+/**
+ * Free the frames in the free list. Frames still out are freed by their
+ * holder.
+ */
+void ff_topscodec_frame_pool_uninit(EFFramePool* pool);
+
+/* a blank frame, allocates only when every frame is out */
+AVFrame* ff_topscodec_frame_pool_get(EFFramePool* pool);
+
+/* unref the frame and return it to the free list */
+void ff_topscodec_frame_pool_put(EFFramePool* pool, AVFrame* frame);
+
+/*
+ * Pts of the packets sent in coalesced batches. The codec only sees the pts
+ * of the first packet of a batch, the batch pts it reports on the frames, so
+ * every output frame takes the smallest pending pts of its batch instead,
+ * frames come out in display order. Entries are kept in arrival order.
+ */
+typedef struct {
+    int64_t pts;
+    int64_t batch; /* the pts the codec got for the batch of the packet */
+} EFPtsEntry;
+
+typedef struct {
+    EFPtsEntry* pts; /* arrival order */
+    int         nb_pts;
+    int         size;
+} EFPtsQueue;
+
+/* returns 0 in case of success, AVERROR(ENOMEM) otherwise */
+int ff_topscodec_pts_queue_push(EFPtsQueue* queue, int64_t pts, int64_t batch);
+
+/**
+ * The pts of the next frame, batch is the pts the codec reported for it.
+ * Within the pending entries of its batch (all entries if none match), a
+ * packet without pts that arrived first goes first, otherwise the smallest
+ * pts before the next packet without pts. Entries with a smaller pts than the
+ * one returned lost their frame (dropped or merged by the codec) and are
+ * dropped too, so one lost frame does not shift every later pts.
+ *
+ * @returns the pts, AV_NOPTS_VALUE if the queue is empty
+ */
+int64_t ff_topscodec_pts_queue_pop(EFPtsQueue* queue, int64_t batch);
+
+void ff_topscodec_pts_queue_uninit(EFPtsQueue* queue);
+
+/**
+ * Take an EFBuffer from the decoder's slot pool, one per mapped frame so
+ * frames held by the caller never share an ef_frame. The caller owns one
+ * reference, each zero-copy plane takes another one.
+ *
+ * @returns the cleared EFBuffer, NULL if the pool is out of memory
+ */
+EFBuffer* ff_topscodec_efbuf_get(AVBufferPool* pool, AVCodecContext* avctx, void* ef_context);
+
+/**
+ * Drop one reference, the last one unmaps ef_frame and gives the EFBuffer
+ * back to its pool. Only handle and lib are used, not the decoder.
+ */
+void ff_topscodec_efbuf_unref(EFBuffer* efbuf);
+
+/**
+ * Give an EFBuffer whose ef_frame was never mapped back to its pool, with
+ * its library reference.
+ */
+void ff_topscodec_efbuf_release(EFBuffer* efbuf);
+
 /**
  * Extracts the data from a EFBuffer to an AVFrame
  *
@@ -76,6 +223,8 @@ typedef struct {
  */
 int ff_topscodec_efbuf_to_avframe(const EFBuffer* efbuf, AVFrame* avframe);
 
+int ff_topscodec_efbuf_to_companion(const EFBuffer* efbuf, AVFrame* avframe);
+
 /**
  * Extracts the data from an AVFrame to a EFBuffer
  *
@@ -108,6 +257,17 @@ int ff_topscodec_efbuf_to_avpkt(const EFBuffer* efbuf, AVPacket* avpkt);
  */
 int ff_topscodec_avpkt_to_efbuf(const AVPacket* pkt, EFBuffer* efbuf);
 
+/**
+ * Appends an AVPacket behind the data already in the EFBuffer stream, the
+ * stream keeps the pts of its first packet
+ *
+ * @param[in]  pkt AVPacket to get the data from
+ * @param[in]  efbuf EFBuffer filled by ff_topscodec_avpkt_to_efbuf()
+ *
+ * @returns 0 in case of success, a negative AVERROR code otherwise
+ */
+int ff_topscodec_avpkt_append_efbuf(const AVPacket* pkt, EFBuffer* efbuf);
+
 /* useful pix trans func */
 topscodecPixelFormat_t avpixfmt_2_topspixfmt(enum AVPixelFormat fmt);
 enum AVPixelFormat     topspixfmt_2_avpixfmt(topscodecPixelFormat_t fmt);
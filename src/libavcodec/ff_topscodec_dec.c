@@ -66,6 +66,50 @@ static pthread_mutex_t g_dec_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define FF_EFC_PATCH_VERSION 1
 
 #define FF_IDR_MAGIC (16384)
+#define MAX_DEVICE_ID (32)
+
+/*
+ * The topscodec symbol table is shared by all decoders of the process, loaded
+ * by the first open and freed by the last close. Both under g_dec_mutex.
+ */
+static TopsCodecFunctions* g_codec_lib     = NULL;
+static int                 g_codec_lib_ref = 0;
+
+static int topscodec_lib_acquire(TopsCodecFunctions** lib) {
+    int ret = 0;
+
+    pthread_mutex_lock(&g_dec_mutex);
+    if (!g_codec_lib_ref) ret = topscodec_load_functions(&g_codec_lib);
+    if (ret == 0) {
+        g_codec_lib_ref++;
+        *lib = g_codec_lib;
+    }
+    pthread_mutex_unlock(&g_dec_mutex);
+    return ret;
+}
+
+static void topscodec_lib_release(TopsCodecFunctions** lib) {
+    if (!*lib) return;
+    pthread_mutex_lock(&g_dec_mutex);
+    if (--g_codec_lib_ref == 0) topscodec_free_functions(&g_codec_lib);
+    pthread_mutex_unlock(&g_dec_mutex);
+    *lib = NULL;
+}
+
+/* an EFBuffer for a frame of handle, it unmaps through its own library reference */
+static EFBuffer* topscodec_efbuf_get(AVCodecContext* avctx, topscodecHandle_t handle) {
+    EFCodecDecContext_t* ctx   = avctx->priv_data;
+    EFBuffer*            efbuf = ff_topscodec_efbuf_get(ctx->ef_buf_pool, avctx, ctx);
+
+    if (!efbuf) return NULL;
+    if (topscodec_lib_acquire(&efbuf->lib) < 0) {
+        ff_topscodec_efbuf_release(efbuf);
+        return NULL;
+    }
+    efbuf->lib_release = topscodec_lib_release;
+    efbuf->handle      = handle;
+    return efbuf;
+}
 
 static topscodecColorSpace_t str_2_topsolorspace(char* str) {
     topscodecColorSpace_t ret = TOPSCODEC_COLOR_SPACE_BT_601;
@@ -113,6 +157,64 @@ static void print_caps(AVCodecContext* avctx, topscodecDecCaps_t* DecCaps) {
     av_log(avctx, AV_LOG_DEBUG, "}                            \t\n");
 }
 
+/*
+ * Caps are static per codec type and device, query the driver once per
+ * (codec, card, device) and serve later opens from here. Failures are not
+ * cached, neither is anything once the table is full.
+ */
+#define TOPSCODEC_CAPS_CACHE_SIZE 64
+static struct {
+    topscodecType_t    codec_type;
+    int                card_id;
+    int                device_id;
+    topscodecDecCaps_t caps;
+} g_caps_cache[TOPSCODEC_CAPS_CACHE_SIZE];
+static int             g_caps_cache_nb    = 0;
+static pthread_mutex_t g_caps_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the cache index of the caps of ctx, -1 if they are not cached, called with g_caps_cache_mutex held */
+static int topscodec_caps_cache_find(EFCodecDecContext_t* ctx) {
+    int i;
+
+    for (i = 0; i < g_caps_cache_nb; i++)
+        if (g_caps_cache[i].codec_type == ctx->codec_type && g_caps_cache[i].card_id == ctx->card_id &&
+            g_caps_cache[i].device_id == ctx->device_id)
+            return i;
+    return -1;
+}
+
+static int topscodec_get_caps(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    int                  ret;
+    int                  i;
+
+    pthread_mutex_lock(&g_caps_cache_mutex);
+    i = topscodec_caps_cache_find(ctx);
+    if (i >= 0) {
+        ctx->caps = g_caps_cache[i].caps;
+        pthread_mutex_unlock(&g_caps_cache_mutex);
+        av_log(avctx, AV_LOG_DEBUG, "topscodecDecGetCaps: cached\n");
+        return TOPSCODEC_SUCCESS;
+    }
+    pthread_mutex_unlock(&g_caps_cache_mutex);
+
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecGetCaps(ctx->codec_type, ctx->card_id, ctx->device_id, &ctx->caps);
+    if (TOPSCODEC_SUCCESS != ret) return ret;
+    print_caps(avctx, &ctx->caps);
+
+    pthread_mutex_lock(&g_caps_cache_mutex);
+    /* another open may have queried the same caps meanwhile, keep its entry */
+    if (topscodec_caps_cache_find(ctx) < 0 && g_caps_cache_nb < TOPSCODEC_CAPS_CACHE_SIZE) {
+        g_caps_cache[g_caps_cache_nb].codec_type = ctx->codec_type;
+        g_caps_cache[g_caps_cache_nb].card_id    = ctx->card_id;
+        g_caps_cache[g_caps_cache_nb].device_id  = ctx->device_id;
+        g_caps_cache[g_caps_cache_nb].caps       = ctx->caps;
+        g_caps_cache_nb++;
+    }
+    pthread_mutex_unlock(&g_caps_cache_mutex);
+    return TOPSCODEC_SUCCESS;
+}
+
 static void print_create_info(AVCodecContext* avctx, topscodecDecCreateInfo_t* create_info) {
     av_log(avctx, AV_LOG_DEBUG, "topscodecDecCreateInfo_t info {.\n");
     av_log(avctx, AV_LOG_DEBUG, "card_id(%d)                  \t\n", create_info->device_id);
@@ -257,38 +359,184 @@ static void sleep_wait(int* sleep_handle) {
     }
 }
 
-static i32_t decode_callback(topscodecHandle_t handle, topscodecEventType_t event, void* event_data, void* user_data) {
-    int                  ret   = 0;
-    int                  idx   = 0;
-    AVCodecContext*      avctx = (AVCodecContext*)user_data;
-    EFCodecDecContext_t* ctx   = (EFCodecDecContext_t*)(avctx->priv_data);
-    topscodecFrame_t*    frame = (topscodecFrame_t*)(event_data);
-    // AVFrame*             avframe = ctx->last_received_frame[ctx->idx_put];
+static int topscodec_event_init(EFCodecDecContext_t* ctx) {
+    pthread_condattr_t attr;
+    int                ret;
+
+    ret = pthread_mutex_init(&ctx->event_mutex, NULL);
+    if (ret) return AVERROR(ret);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    ret = pthread_cond_init(&ctx->event_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ret) {
+        pthread_mutex_destroy(&ctx->event_mutex);
+        return AVERROR(ret);
+    }
+    ctx->event_seq  = 0;
+    ctx->event_init = 1;
+    return 0;
+}
+
+static void topscodec_event_uninit(EFCodecDecContext_t* ctx) {
+    if (!ctx->event_init) return;
+    pthread_cond_destroy(&ctx->event_cond);
+    pthread_mutex_destroy(&ctx->event_mutex);
+    ctx->event_init = 0;
+}
+
+static unsigned int topscodec_event_seq(EFCodecDecContext_t* ctx) {
+    unsigned int seq;
+    pthread_mutex_lock(&ctx->event_mutex);
+    seq = ctx->event_seq;
+    pthread_mutex_unlock(&ctx->event_mutex);
+    return seq;
+}
+
+static void topscodec_event_signal(EFCodecDecContext_t* ctx) {
+    pthread_mutex_lock(&ctx->event_mutex);
+    ctx->event_seq++;
+    pthread_cond_broadcast(&ctx->event_cond);
+    pthread_mutex_unlock(&ctx->event_mutex);
+}
+
+/*
+ * Wait until the hardware makes progress. In event mode with callback the
+ * caller sleeps on the condition until decode_callback bumps event_seq past
+ * the value sampled before the failed attempt (or wait_timeout expires);
+ * otherwise fall back to the sleep_wait() back off.
+ */
+static void topscodec_wait(EFCodecDecContext_t* ctx, unsigned int seq, int* sleep_handle) {
+    struct timespec ts;
+
+    if (ctx->wait_mode != TOPSCODEC_WAIT_EVENT || !ctx->callback) {
+        sleep_wait(sleep_handle);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ctx->wait_timeout / 1000;
+    ts.tv_nsec += (long)(ctx->wait_timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&ctx->event_mutex);
+    while (ctx->event_seq == seq) {
+        if (pthread_cond_timedwait(&ctx->event_cond, &ctx->event_mutex, &ts) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&ctx->event_mutex);
+}
+
+/*
+ * Whether to wait for output again after EAGAIN. A drain waits until EOS,
+ * bounded by recv_timeout per frame when it is set. Before the first frame we
+ * wait until recv_timeout after the first packet, once for the whole startup
+ * and not per packet, so that the first packets already return their frames
+ * and callers need no sleep after them. 1 to retry, 0 to return EAGAIN,
+ * AVERROR(ETIMEDOUT) when a bounded drain got nothing.
+ */
+static int topscodec_recv_wait(AVCodecContext* avctx, unsigned int seq, int* sleep_handle, int64_t* deadline) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+
+    /* a packet still waiting in a coalescing batch has nothing to wait for */
+    if (!ctx->draining && (ctx->recv_timeout <= 0 || atomic_load(&ctx->recv_first_frame) || ctx->coalesce_nb > 0))
+        return 0;
+    if (!ctx->draining) {
+        if (av_gettime_relative() >= ctx->first_frame_deadline) return 0;
+    } else if (ctx->recv_timeout > 0) {
+        if (!*deadline) {
+            *deadline = av_gettime_relative() + ctx->recv_timeout * 1000LL;
+        } else if (av_gettime_relative() >= *deadline) {
+            av_log(avctx, AV_LOG_ERROR, "no frame for %dms while draining\n", ctx->recv_timeout);
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+    if (!ctx->draining || ctx->wait_mode == TOPSCODEC_WAIT_EVENT) topscodec_wait(ctx, seq, sleep_handle);
+    return 1;
+}
+
+/*
+ * Timeout handed to topscodecDecodeStream. In sync event mode the driver
+ * blocks until an input slot is free instead of us spinning around it.
+ */
+static i32_t topscodec_stream_timeout(EFCodecDecContext_t* ctx) {
+    if (ctx->wait_mode == TOPSCODEC_WAIT_EVENT && !ctx->callback) return ctx->wait_timeout;
+    return 0;
+}
+
+/*
+ * out_fps: the first frame whose pts falls into a new 1/out_fps slot is kept,
+ * so the output rate follows the timestamps and not the frame count.
+ */
+static int topscodec_out_fps_drop(AVCodecContext* avctx, int64_t pts) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    int64_t              slot;
+
+    if (!ctx->out_fps.num || pts == AV_NOPTS_VALUE || !avctx->pkt_timebase.num || !avctx->pkt_timebase.den)
+        return 0;
+    slot = av_rescale_q_rnd(pts, avctx->pkt_timebase, av_inv_q(ctx->out_fps), AV_ROUND_DOWN);
+    if (slot <= ctx->out_fps_slot) {
+        av_log(avctx, AV_LOG_DEBUG, "out_fps drop pts:%" PRId64 ", slot:%" PRId64 "\n", pts, slot);
+        return 1;
+    }
+    ctx->out_fps_slot = slot;
+    return 0;
+}
+
+static i32_t topscodec_callback_event(topscodecHandle_t handle, topscodecEventType_t event, void* event_data,
+                                      void* user_data) {
+    int                  ret          = 0;
+    int                  sleep_handle = 0;
+    AVCodecContext*      avctx        = (AVCodecContext*)user_data;
+    EFCodecDecContext_t* ctx          = (EFCodecDecContext_t*)(avctx->priv_data);
+    topscodecFrame_t*    frame        = (topscodecFrame_t*)(event_data);
+    AVFrame*             avframe      = NULL;
+    EFBuffer*            efbuf        = NULL;
 
-    AVFrame* avframe = av_frame_alloc();
     av_log(avctx, AV_LOG_DEBUG, "got codec callback event %s, user_data %p\n", get_event_type_string(event), user_data);
     switch (event) {
         case TOPSCODEC_EVENT_NEW_FRAME:
-            // check if the queue is full
-            // while ((ctx->idx_put + 1) % MAX_FRAME_NUM == ctx->idx_get) {
-            //     av_usleep(10);  // wait for get
-            // }
-            // idx = ctx->idx_put;
-            memcpy(&ctx->ef_buf_frame[idx]->ef_frame, frame, sizeof(topscodecFrame_t));
-            if (!ctx->recv_first_frame) ctx->recv_first_frame = 1;
-            ctx->total_frame_count++;
+            /* with coalescing the real pts is only known when the frame is read from the ring */
+            if (!ctx->coalesce && topscodec_out_fps_drop(avctx, frame->pts)) {
+                ctx->topscodec_lib_ctx->lib_topscodecDecFrameUnmap(ctx->handle, frame);
+                topscodec_event_signal(ctx);
+                return 0;
+            }
+            // wait for the consumer to free a slot, this backpressures the codec
+            while (atomic_load(&ctx->mid_frame_abort) ||
+                   !(avframe = ff_topscodec_ring_write_slot(&ctx->mid_frame_ring))) {
+                if (atomic_load(&ctx->mid_frame_abort)) {
+                    av_log(avctx, AV_LOG_DEBUG, "decoder closing, drop frame pts:%lu\n", frame->pts);
+                    ctx->topscodec_lib_ctx->lib_topscodecDecFrameUnmap(ctx->handle, frame);
+                    return 0;
+                }
+                sleep_wait(&sleep_handle);
+            }
+            /* unmapped against this handle even if a reset flush replaces ctx->handle meanwhile */
+            efbuf = topscodec_efbuf_get(avctx, ctx->handle);
+            if (!efbuf) {
+                av_log(avctx, AV_LOG_ERROR, "no EFBuffer for frame pts:%lu\n", frame->pts);
+                ctx->topscodec_lib_ctx->lib_topscodecDecFrameUnmap(ctx->handle, frame);
+                return AVERROR(ENOMEM);
+            }
+            memcpy(&efbuf->ef_frame, frame, sizeof(topscodecFrame_t));
+            atomic_store(&ctx->recv_first_frame, 1);
+            atomic_fetch_add(&ctx->total_frame_count, 1);
 
             if (avctx->pix_fmt == AV_PIX_FMT_TOPSCODEC) {
-                ctx->ef_buf_frame[idx]->avctx      = avctx;
-                ctx->ef_buf_frame[idx]->ef_context = ctx;
-                ret                                = ff_topscodec_efbuf_to_avframe(ctx->ef_buf_frame[idx], avframe);
-                if (ret < 0) return AVERROR_BUG;
+                ret = ff_topscodec_efbuf_to_avframe(efbuf, avframe);
+                ff_topscodec_efbuf_unref(efbuf);
+                if (ret < 0) {
+                    av_frame_unref(avframe);
+                    return AVERROR_BUG;
+                }
             } else {
-                ctx->ef_buf_frame[idx]->avctx      = avctx;
-                ctx->ef_buf_frame[idx]->ef_context = ctx;
-                ret = ff_topscodec_efbuf_to_avframe(ctx->ef_buf_frame[idx], &ctx->mid_frame);
+                ret = ff_topscodec_efbuf_to_avframe(efbuf, &ctx->mid_frame);
+                ff_topscodec_efbuf_unref(efbuf);
                 if (ret < 0) return AVERROR_BUG;
-                // topspixfmt_2_avpixfmt(ctx->ef_buf_frame[idx]->ef_frame.pixel_format);
+                // topspixfmt_2_avpixfmt(efbuf->ef_frame.pixel_format);
                 avframe->format = ctx->mid_frame.format;
                 avframe->width  = ctx->mid_frame.width;
                 avframe->height = ctx->mid_frame.height;
@@ -296,6 +544,7 @@ static i32_t decode_callback(topscodecHandle_t handle, topscodecEventType_t even
                 if (ret) {
                     av_log(avctx, AV_LOG_ERROR, "av_hwframe_transfer_data failed\n");
                     av_frame_unref(&ctx->mid_frame);
+                    av_frame_unref(avframe);
                     return AVERROR_BUG;
                 }
                 //  dump_frame_info(&ctx->mid_frame);
@@ -305,26 +554,27 @@ static i32_t decode_callback(topscodecHandle_t handle, topscodecEventType_t even
                 avframe->nb_samples     = ctx->mid_frame.nb_samples;
                 av_frame_unref(&ctx->mid_frame);
             }
-            if (av_fifo_space(ctx->mid_avframe_fifo) < sizeof(AVFrame*)) {
-                av_fifo_grow(ctx->mid_avframe_fifo, 5 * sizeof(AVFrame*));
-                av_log(avctx, AV_LOG_DEBUG, "mid_frame fifo grow success, size:%d.\n",
-                       av_fifo_size(ctx->mid_avframe_fifo));
-            }
-            av_fifo_generic_write(ctx->mid_avframe_fifo, &avframe, sizeof(AVFrame*), NULL);
-            av_log(avctx, AV_LOG_DEBUG, "mid_frame fifo [%p] write success, size:%d.\n", avframe,
-                   av_fifo_size(ctx->mid_avframe_fifo));
-            // ctx->idx_put = (ctx->idx_put + 1) % MAX_FRAME_NUM;
-            // av_log(avctx, AV_LOG_DEBUG, "add frame to queue,put:%d,get:%d!\n", ctx->idx_put, ctx->idx_get);
+            ff_topscodec_ring_write_commit(&ctx->mid_frame_ring);
+            av_log(avctx, AV_LOG_DEBUG, "mid_frame ring [%p] write success, size:%u.\n", avframe,
+                   ff_topscodec_ring_count(&ctx->mid_frame_ring));
+            topscodec_event_signal(ctx);
             break;
 
         case TOPSCODEC_EVENT_SEQUENCE:
+            /* new geometry, the frames that follow carry it and get a new frames context */
+            av_log(avctx, AV_LOG_DEBUG, "received SEQUENCE event\n");
+            topscodec_event_signal(ctx);
+            break;
         case TOPSCODEC_EVENT_EOS:
-            ctx->recv_outport_eos = 1;
+            atomic_store(&ctx->recv_outport_eos, 1);
             av_log(NULL, AV_LOG_DEBUG, "----Callback-EOS -----\n");
+            topscodec_event_signal(ctx);
             break;
         case TOPSCODEC_EVENT_FRAME_PROCESSED:
         case TOPSCODEC_EVENT_BITSTREAM_PROCESSED:
             av_log(NULL, AV_LOG_DEBUG, "received BITSTREAM_PROCESSED event\n");
+            /* an input slot is free again */
+            topscodec_event_signal(ctx);
             break;
         case TOPSCODEC_EVENT_OUT_OF_MEMORY:
         case TOPSCODEC_EVENT_STREAM_CORRUPT:
@@ -332,28 +582,1091 @@ static i32_t decode_callback(topscodecHandle_t handle, topscodecEventType_t even
         case TOPSCODEC_EVENT_BUFFER_OVERFLOW:
         case TOPSCODEC_EVENT_FATAL_ERROR:
             av_log(NULL, AV_LOG_ERROR, "Fatal error.\n");
+            topscodec_event_signal(ctx);
             return AVERROR_BUG;
         default:
             av_log(NULL, AV_LOG_DEBUG, "unknown codec callback event %d\n", event);
             return AVERROR_BUG;
     }
-    return 0;
+    return 0;
+}
+
+/* counted so the ring can be drained with no producer left, see topscodec_ring_drain() */
+static i32_t decode_callback(topscodecHandle_t handle, topscodecEventType_t event, void* event_data, void* user_data) {
+    EFCodecDecContext_t* ctx = ((AVCodecContext*)user_data)->priv_data;
+    i32_t                ret;
+
+    atomic_fetch_add(&ctx->mid_frame_busy, 1);
+    ret = topscodec_callback_event(handle, event, event_data, user_data);
+    atomic_fetch_sub(&ctx->mid_frame_busy, 1);
+    return ret;
+}
+
+/* -1 if TOPSCODEC_CARD_ID is not a card number */
+static int get_card_id_from_env() {
+    char* card_id_str = getenv("TOPSCODEC_CARD_ID");
+    char* end;
+    long  card_id;
+    if (card_id_str == NULL) {
+        return 0;
+    }
+    card_id = strtol(card_id_str, &end, 10);
+    if (end == card_id_str || *end || card_id < 0 || card_id > MAX_DEVICE_ID) return -1;
+    return card_id;
+}
+
+static int get_device_id_from_env() {
+    char* device_id_str = getenv("TOPSCODEC_DEVICE_ID");
+    if (device_id_str == NULL) {
+        return 0;
+    }
+    return atoi(device_id_str);
+}
+
+static void topscodec_reset_state(EFCodecDecContext_t* ctx) {
+    atomic_store(&ctx->total_frame_count, 0);
+    atomic_store(&ctx->total_packet_count, 0);
+    atomic_store(&ctx->recv_first_frame, 0);
+    atomic_store(&ctx->recv_outport_eos, 0);
+    atomic_store(&ctx->mid_frame_abort, 0);
+    ctx->draining     = 0;
+    ctx->first_packet = 1;
+    ctx->idx_get      = 0;
+    ctx->idx_put      = 0;
+    ctx->count        = 0;
+    ctx->coalesce_nb  = 0;
+    /* pts of packets dropped with the old handle */
+    ctx->coalesce_pts.nb_pts = 0;
+    ctx->out_fps_slot        = INT64_MIN;
+}
+
+/* the codec accepted the packet in the current slot, upload the next one into the following slot */
+static void topscodec_stream_slot_next(EFCodecDecContext_t* ctx) {
+    ctx->stream_slot = (ctx->stream_slot + 1) % ctx->stream_slot_num;
+    ctx->stream_addr = ctx->stream_base + (u64_t)ctx->stream_slot * ctx->stream_buf_size;
+    ctx->mem_addr    = ctx->mem_base + (u64_t)ctx->stream_slot * ctx->stream_buf_size;
+}
+
+/* stream buffers are accounted on the device context of the decoder */
+static void topscodec_stream_mem_release(EFCodecDecContext_t* ctx, int64_t size) {
+    if (ctx->hwdevice && size)
+        av_topscodec_mem_release((AVHWDeviceContext*)ctx->hwdevice->data, AV_TOPSCODEC_MEM_STREAM, size);
+}
+
+/* allocate stream_slot_num slots of slot_size, the current buffer is left to the caller */
+static int topscodec_stream_buf_alloc(AVCodecContext* avctx, u32_t slot_size) {
+    EFCodecDecContext_t*   ctx      = avctx->priv_data;
+    topsPointerAttribute_t att      = {0};
+    topsError_t            tops_ret = topsSuccess;
+    void*                  tmp      = NULL;
+    int64_t                size     = (int64_t)slot_size * ctx->stream_slot_num;
+    int                    ret;
+
+    /* fails or waits here when the device is over its budget */
+    ret = av_topscodec_mem_reserve((AVHWDeviceContext*)ctx->hwdevice->data, AV_TOPSCODEC_MEM_STREAM, size, 0);
+    if (ret < 0) return ret;
+    tops_ret = ctx->topsruntime_lib_ctx->lib_topsExtMallocWithFlags(&tmp, size, topsMallocHostAccessable);
+    if (topsSuccess != tops_ret) {
+        av_log(avctx, AV_LOG_ERROR, "Error, topsMalloc failed, ret(%d)\n", tops_ret);
+        topscodec_stream_mem_release(ctx, size);
+        return AVERROR(EPERM);
+    }
+    tops_ret = ctx->topsruntime_lib_ctx->lib_topsPointerGetAttributes(&att, tmp);
+    if (tops_ret != topsSuccess) {
+        av_log(avctx, AV_LOG_ERROR, "topsPointerGetAttributes failed!\n");
+        ctx->topsruntime_lib_ctx->lib_topsFree(tmp);
+        topscodec_stream_mem_release(ctx, size);
+        return AVERROR(EPERM);
+    }
+    ctx->stream_buf_size = slot_size;
+    ctx->stream_base     = (uint64_t)tmp;
+    ctx->mem_base        = (u64_t)att.device_pointer;
+    ctx->stream_slot     = 0;
+    ctx->stream_addr     = ctx->stream_base;
+    ctx->mem_addr        = ctx->mem_base;
+    av_log(avctx, AV_LOG_DEBUG, "malloc stream_addr:0x%lx, %d slots of %u\n", ctx->stream_base,
+           ctx->stream_slot_num, ctx->stream_buf_size);
+    return 0;
+}
+
+/* only once the handle is gone, nothing reads the old slots any more */
+static void topscodec_stream_buf_free_retired(EFCodecDecContext_t* ctx) {
+    while (ctx->stream_retired_nb > 0)
+        ctx->topsruntime_lib_ctx->lib_topsFree((void*)ctx->stream_retired[--ctx->stream_retired_nb]);
+    topscodec_stream_mem_release(ctx, ctx->stream_retired_bytes);
+    ctx->stream_retired_bytes = 0;
+}
+
+/* make sure the current slot holds size bytes, in adaptive mode by moving to bigger slots */
+static int topscodec_stream_buf_reserve(AVCodecContext* avctx, int size) {
+    EFCodecDecContext_t* ctx      = avctx->priv_data;
+    u64_t                old_base = ctx->stream_base;
+    u32_t                old_size = ctx->stream_buf_size;
+    int64_t              new_size;
+    int                  ret;
+
+    if (size > ctx->stream_buf_hwm) ctx->stream_buf_hwm = size;
+    if (size <= ctx->stream_buf_size) return 0;
+
+    /* the handle was created with stream_buf_max, slots never grow past it */
+    new_size = FFALIGN(FFMAX((int64_t)size, 2LL * ctx->stream_buf_size), 4096);
+    new_size = FFMIN(new_size, ctx->stream_buf_max);
+    if (ctx->stream_buf_mode != TOPSCODEC_STREAM_BUF_ADAPTIVE || size > ctx->stream_buf_max ||
+        ctx->stream_retired_nb >= TOPSCODEC_STREAM_RETIRED_MAX) {
+        av_log(avctx, AV_LOG_ERROR, "packet of %d bytes does not fit the %u bytes stream buffer\n", size,
+               ctx->stream_buf_size);
+        return AVERROR(ENOSPC);
+    }
+    /* packets still queued in the codec keep pointing into the old slots */
+    ret = topscodec_stream_buf_alloc(avctx, (u32_t)new_size);
+    if (ret < 0) return ret;
+    ctx->stream_retired[ctx->stream_retired_nb++] = old_base;
+    ctx->stream_retired_bytes += (int64_t)old_size * ctx->stream_slot_num;
+    av_log(avctx, AV_LOG_VERBOSE, "stream buffer grows %u -> %u for a %d bytes packet\n", old_size,
+           ctx->stream_buf_size, size);
+    return 0;
+}
+
+/* first guess of the slot size in adaptive mode, one second of the stream at its peak rate */
+static u32_t topscodec_stream_buf_estimate(AVCodecContext* avctx, int probed_dims) {
+    EFCodecDecContext_t* ctx  = avctx->priv_data;
+    int64_t              rate = FFMAX(avctx->rc_max_rate, avctx->bit_rate);
+    int64_t              size;
+
+    if (rate > 0)
+        size = rate / 8;
+    else if (probed_dims)
+        size = ctx->stream_buf_max;
+    else
+        size = TOPSCODEC_STREAM_BUF_MIN;  // caps max would be the fallback, start small instead
+    size = FFMIN(FFMAX(size, TOPSCODEC_STREAM_BUF_MIN), ctx->stream_buf_max);
+    return FFALIGN(size, 4096);
+}
+
+static void topscodec_fill_create_info(AVCodecContext* avctx, topscodecDecCreateInfo_t* info) {
+    EFCodecDecContext_t*     ctx                = avctx->priv_data;
+    topscodecDecCreateInfo_t codec_info         = {0};
+    int                      switch_frames_mode = 0;
+    int                      switch_frames_num  = 0;
+
+    memset(&codec_info, 0, sizeof(topscodecDecCreateInfo_t));
+    codec_info.device_id       = ctx->card_id;
+    codec_info.session_id      = ctx->device_id;
+    codec_info.hw_ctx_id       = ctx->hw_id;
+    codec_info.codec           = ctx->codec_type;
+    codec_info.stream_buf_size = ctx->stream_buf_max;
+    if (ctx->callback == 1) {
+        codec_info.hw_ctx_id    = 0x0F;  // hardware context id 固定值0x0F
+        codec_info.sw_ctx_id    = 0x08;  // software context id 固定值0x08
+        codec_info.run_mode     = TOPSCODEC_RUN_MODE_ASYNC;
+        codec_info.callback     = decode_callback;
+        codec_info.user_context = (u64_t)avctx;
+        av_log(avctx, AV_LOG_DEBUG, "run in async mode\n");
+    } else {
+        codec_info.run_mode     = TOPSCODEC_RUN_MODE_SYNC;
+        codec_info.callback     = NULL;
+        codec_info.user_context = 0;
+        av_log(avctx, AV_LOG_DEBUG, "run in sync mode\n");
+    }
+
+    if (codec_info.codec == TOPSCODEC_VP8 || codec_info.codec == TOPSCODEC_VP9 || codec_info.codec == TOPSCODEC_AV1) {
+        codec_info.send_mode = TOPSCODEC_DEC_SEND_MODE_FRAME;
+    } else {
+        codec_info.send_mode = TOPSCODEC_DEC_SEND_MODE_STREAM;
+    }
+
+    /*
+     * sf setting
+     */
+    switch_frames_num       = ctx->sf;
+    switch_frames_mode      = 1;
+    codec_info.reserved[9]  = switch_frames_mode;
+    codec_info.reserved[10] = switch_frames_num;
+
+#ifdef TOPS_LOG
+    /* ap log setting*/
+    codec_info.reserved[0] = 1;
+    codec_info.reserved[1] = 1;
+    /* Log level */
+    for (int i = 0; i < 7; i++) {
+        codec_info.reserved[i + 2] = 4;
+    }
+#endif
+    memcpy(info, &codec_info, sizeof(codec_info));
+}
+
+/* decode order skips the reorder wait in the DPB, for streams without B frames or reordered by the caller */
+static int topscodec_decode_order(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+
+    return ctx->output_order == TOPSCODEC_DEC_OUTPUT_ORDER_DECODE || (avctx->flags & AV_CODEC_FLAG_LOW_DELAY);
+}
+
+/* the params are memset first, so that two sessions with the same settings compare equal */
+static int topscodec_fill_params(AVCodecContext* avctx, topscodecDecParams_t* out) {
+    EFCodecDecContext_t* ctx    = avctx->priv_data;
+    topscodecDecParams_t params = {0};
+    int                  ret    = 0;
+
+    memset(&params, 0, sizeof(topscodecDecParams_t));
+    params.pixel_format = avpixfmt_2_topspixfmt(ctx->output_pixfmt);
+    av_log(avctx, AV_LOG_DEBUG, "Out pixfmt: (%d)%s\n", params.pixel_format,
+           av_pix_fmt_desc_get(ctx->output_pixfmt)->name);
+
+    params.color_space = str_2_topsolorspace(ctx->color_space);
+    av_log(avctx, AV_LOG_DEBUG, "Out Colorspace: %s\n", ctx->color_space);
+
+    if (topscodec_decode_order(avctx))
+        params.output_order = TOPSCODEC_DEC_OUTPUT_ORDER_DECODE;
+    else
+        params.output_order = TOPSCODEC_DEC_OUTPUT_ORDER_DISPLAY;
+
+    params.reserved[4] = ctx->input_buf_num;
+    av_log(avctx, AV_LOG_DEBUG, "input_buf_num: %d\n", ctx->input_buf_num);
+
+    params.output_buf_num = ctx->output_buf_num;
+    av_log(avctx, AV_LOG_DEBUG, "output_buf_num: %d\n", ctx->output_buf_num);
+
+    if (ctx->enable_crop && ctx->enable_rotation) {
+        av_log(avctx, AV_LOG_ERROR,
+               "Set Parameter error, Rotation and Crop "
+               "can not be set at the same time. \n");
+        ret = AVERROR(EINVAL);
+        goto error;
+    }
+
+    if (ctx->enable_crop && ctx->enable_resize) {
+        av_log(avctx, AV_LOG_ERROR,
+               "Set Parameter error, Downscale resize "
+               "and Crop can not be set at the same time. \n");
+        ret = AVERROR(EINVAL);
+        goto error;
+    }
+
+    if (ctx->enable_sfo && (ctx->sfo * ctx->sf_idr != 0)) {
+        av_log(avctx, AV_LOG_ERROR,
+               "Set Parameter error, Frame sampling"
+               " interval and IDR Frame sampling can not be set at the same "
+               "time.\n");
+        ret = AVERROR(EINVAL);
+        goto error;
+    }
+
+    if (ctx->enable_resize) {
+        params.pp_attr.downscale.enable = 1;
+        params.pp_attr.downscale.width  = ctx->resize.width;
+        params.pp_attr.downscale.height = ctx->resize.height;
+        /*!< Downscale mode: 0-Bilinear, 1-Nearest*/
+        params.pp_attr.downscale.interDslMode = ctx->resize.mode;
+        av_log(avctx, AV_LOG_DEBUG, "Setting resize, %dx%d->%dx%d.\n", avctx->width, avctx->height, ctx->resize.width,
+               ctx->resize.height);
+    }
+
+    /* Set Crop Parameter */
+    if (ctx->enable_crop) {
+        params.pp_attr.crop.enable = 1;
+        params.pp_attr.crop.tl_x   = ctx->crop.left;
+        params.pp_attr.crop.tl_y   = ctx->crop.top;
+        params.pp_attr.crop.br_x   = ctx->crop.right;
+        params.pp_attr.crop.br_y   = ctx->crop.bottom;
+        av_log(avctx, AV_LOG_DEBUG,
+               "Setting crop,src dim:(%dx%d),crop dim:"
+               "((left,top)(right,bottom)):"
+               "((%dx%d),(%dx%d))\n",
+               avctx->width, avctx->height, ctx->crop.left, ctx->crop.top, ctx->crop.right, ctx->crop.bottom);
+    }
+
+    /* Set Rotation Parameter */
+    if (ctx->enable_rotation) {
+        params.pp_attr.rotation.enable = 1;
+        switch (ctx->rotation) {
+            case 90:
+                params.pp_attr.rotation.rotation = TOPSCODEC_ROTATION_90;
+                break;
+            case 180:
+                params.pp_attr.rotation.rotation = TOPSCODEC_ROTATION_180;
+                break;
+            case 270:
+                params.pp_attr.rotation.rotation = TOPSCODEC_ROTATION_270;
+                break;
+            default:
+                break;
+        }
+        av_log(avctx, AV_LOG_DEBUG, "Setting rotation, rotation:%d\n", ctx->rotation);
+    }
+
+    if (ctx->enable_sfo) {
+        params.pp_attr.sf.enable = 1;
+        if (ctx->sfo != 0)
+            params.pp_attr.sf.sfo = ctx->sfo;
+        else if (ctx->sf_idr != 0)
+            params.pp_attr.sf.sf_idr = FF_IDR_MAGIC;
+
+        av_log(avctx, AV_LOG_DEBUG, "Setting sampling interval value, sfo:%d,sf_idr:%d\n", ctx->sfo, FF_IDR_MAGIC);
+    } else if (avctx->skip_frame >= AVDISCARD_NONKEY && !ctx->coalesce) {
+        /* the codec keeps only IDR frames, the others are never mapped or copied */
+        params.pp_attr.sf.enable = 1;
+        params.pp_attr.sf.sf_idr = FF_IDR_MAGIC;
+        av_log(avctx, AV_LOG_DEBUG, "Setting IDR sampling for skip_frame:%d\n", avctx->skip_frame);
+    }
+    memcpy(out, &params, sizeof(params));
+    return 0;
+
+error:
+    return ret;
+}
+
+/* the options topscodec_fill_params() turns into pp_attr crop/downscale/rotation */
+static void topscodec_pp_fields(EFCodecDecContext_t* ctx, int* fields[TOPSCODEC_PP_FIELDS]) {
+    fields[0]  = &ctx->enable_crop;
+    fields[1]  = &ctx->enable_resize;
+    fields[2]  = &ctx->enable_rotation;
+    fields[3]  = &ctx->crop.top;
+    fields[4]  = &ctx->crop.bottom;
+    fields[5]  = &ctx->crop.left;
+    fields[6]  = &ctx->crop.right;
+    fields[7]  = &ctx->resize.width;
+    fields[8]  = &ctx->resize.height;
+    fields[9]  = &ctx->resize.mode;
+    fields[10] = &ctx->rotation;
+}
+
+/* 1 when the options differ from what the handle was last given */
+static int topscodec_pp_changed(EFCodecDecContext_t* ctx) {
+    int* fields[TOPSCODEC_PP_FIELDS];
+    int  i;
+
+    topscodec_pp_fields(ctx, fields);
+    for (i = 0; i < TOPSCODEC_PP_FIELDS; i++)
+        if (*fields[i] != ctx->pp_applied[i]) return 1;
+    return 0;
+}
+
+static void topscodec_pp_snapshot(EFCodecDecContext_t* ctx) {
+    int* fields[TOPSCODEC_PP_FIELDS];
+    int  i;
+
+    topscodec_pp_fields(ctx, fields);
+    for (i = 0; i < TOPSCODEC_PP_FIELDS; i++) ctx->pp_applied[i] = *fields[i];
+    ctx->pp_pending = 0;
+}
+
+static void topscodec_pp_revert(EFCodecDecContext_t* ctx) {
+    int* fields[TOPSCODEC_PP_FIELDS];
+    int  i;
+
+    topscodec_pp_fields(ctx, fields);
+    for (i = 0; i < TOPSCODEC_PP_FIELDS; i++) *fields[i] = ctx->pp_applied[i];
+    ctx->pp_pending = 0;
+}
+
+/* topscodecDecCreate and topscodecDecSetParams, *handle is left set on a SetParams failure */
+static int topscodec_open_handle(AVCodecContext* avctx, topscodecHandle_t* handle, topscodecDecCreateInfo_t* info,
+                                 topscodecDecParams_t* params) {
+    EFCodecDecContext_t* ctx   = avctx->priv_data;
+    int                  ret   = 0;
+    int                  delay = 50;
+    int64_t              deadline;
+
+    /*create codec*/
+    print_create_info(avctx, info);
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecCreate(handle, info);
+    if (TOPSCODEC_SUCCESS != ret) {
+        av_log(avctx, AV_LOG_ERROR, "Error, topscodecDecCreate failed, ret(%d)\n", ret);
+        return AVERROR(EINVAL);
+    }
+    av_log(avctx, AV_LOG_DEBUG, "topscodecDecCreate successful, handle:0x%p\n", *handle);
+    /*
+     * set codec params, a freshly created handle may time out on them for a
+     * short while, try right away and back off only while it does, up to
+     * wait_timeout. The SDK does not say which code a handle that is not ready
+     * yet returns, so any other error gets one more try after the 1ms the
+     * create used to sleep before SetParams, then it is final.
+     */
+    print_param(avctx, params);
+    av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams, handle:%p\n", *handle);
+    deadline = av_gettime_relative() + ctx->wait_timeout * 1000LL;
+    ret      = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(*handle, params);
+    if (TOPSCODEC_SUCCESS != ret && TOPSCODEC_ERROR_TIMEOUT != ret) {
+        av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams failed right after create, ret(%d), retry in 1ms\n", ret);
+        av_usleep(1000);
+        ret = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(*handle, params);
+    }
+    while (TOPSCODEC_ERROR_TIMEOUT == ret && av_gettime_relative() < deadline) {
+        av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams not ready, ret(%d), retry in %dus\n", ret, delay);
+        av_usleep(delay);
+        delay = FFMIN(delay * 2, 1000);
+        ret   = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(*handle, params);
+    }
+    if (TOPSCODEC_SUCCESS != ret) {
+        av_log(avctx, AV_LOG_ERROR, "Error, topscodecDecSetParams failed, ret(%d)\n", ret);
+        return AVERROR(EINVAL);
+    }
+    av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams success\n");
+    return 0;
+}
+
+/* create the codec handle and set its params, everything else must already be set up */
+static int topscodec_create_handle(AVCodecContext* avctx) {
+    EFCodecDecContext_t*     ctx        = avctx->priv_data;
+    topscodecDecCreateInfo_t codec_info = {0};
+    topscodecDecParams_t     params     = {0};
+    int                      ret        = 0;
+
+    topscodec_fill_create_info(avctx, &codec_info);
+    ret = topscodec_fill_params(avctx, &params);
+    if (ret < 0) return ret;
+
+    ret = topscodec_open_handle(avctx, &ctx->handle, &codec_info, &params);
+    if (ret < 0) return ret;
+    ctx->skip_frame = avctx->skip_frame;
+    topscodec_pp_snapshot(ctx);
+    return 0;
+}
+
+/*
+ * drop the frames left in the ring while the handle they were mapped from is
+ * still alive, the callback stops writing into it before
+ */
+static void topscodec_ring_drain(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx          = avctx->priv_data;
+    int                  sleep_handle = 0;
+
+    atomic_store(&ctx->mid_frame_abort, 1);
+    while (atomic_load(&ctx->mid_frame_busy) > 0) sleep_wait(&sleep_handle);
+    if (ff_topscodec_ring_count(&ctx->mid_frame_ring) > 0)
+        av_log(avctx, AV_LOG_DEBUG, "drop %u frames of the ring\n", ff_topscodec_ring_count(&ctx->mid_frame_ring));
+    ff_topscodec_ring_reset(&ctx->mid_frame_ring);
+}
+
+static void topscodec_destroy_handle(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+
+    /* a callback blocked on a full ring must not hold up the destroy */
+    atomic_store(&ctx->mid_frame_abort, 1);
+    if (ctx->handle) {
+        /*destory codec dec*/
+        ctx->topscodec_lib_ctx->lib_topscodecDecDestroy(ctx->handle);
+        ctx->handle = 0;
+        av_log(avctx, AV_LOG_DEBUG, "topscodecDecDestroy success\n");
+    }
+}
+
+/*
+ * Companion: a second handle is fed the same stream slots as the main one,
+ * with the downscaler on, and its frames are paired by pts with the full
+ * size ones. The VPU decodes the stream twice, the host does no
+ * decode or scaling of its own.
+ */
+static int topscodec_companion_params(AVCodecContext* avctx, topscodecDecParams_t* params) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    int                  ret;
+
+    ret = topscodec_fill_params(avctx, params);
+    if (ret < 0) return ret;
+    /* downscale and crop are exclusive, the companion always shows the whole picture */
+    params->pp_attr.crop.enable            = 0;
+    params->pp_attr.downscale.enable       = 1;
+    params->pp_attr.downscale.width        = ctx->companion.width;
+    params->pp_attr.downscale.height       = ctx->companion.height;
+    params->pp_attr.downscale.interDslMode = ctx->companion.mode;
+    return 0;
+}
+
+static int topscodec_companion_create(AVCodecContext* avctx) {
+    EFCodecDecContext_t*     ctx = avctx->priv_data;
+    topscodecDecCreateInfo_t codec_info;
+    topscodecDecParams_t     params;
+    AVHWFramesContext*       frames;
+    int                      ret;
+
+    if (!ctx->companion.width || !ctx->companion.height) return 0;
+    if (ctx->callback) {
+        av_log(avctx, AV_LOG_WARNING, "companion frames need callback 0, disabled.\n");
+        return 0;
+    }
+    if (ctx->companion.width > ctx->in_width || ctx->companion.height > ctx->in_height) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid companion dim %dx%d, only support downscale.\n", ctx->companion.width,
+               ctx->companion.height);
+        return AVERROR(EINVAL);
+    }
+    if (!ctx->companion_fifo) {
+        ctx->companion_fifo = av_fifo_alloc(MAX_FRAME_NUM * sizeof(EFBuffer*));
+        if (!ctx->companion_fifo) return AVERROR(ENOMEM);
+    }
+
+    topscodec_fill_create_info(avctx, &codec_info);
+    ret = topscodec_companion_params(avctx, &params);
+    if (ret < 0) return ret;
+    ret = topscodec_open_handle(avctx, &ctx->companion_handle, &codec_info, &params);
+    if (ret < 0) goto fail;
+
+    /* no buffers are allocated from it, it lets the companion frames be downloaded */
+    ctx->companion_frames = av_hwframe_ctx_alloc(ctx->hwdevice);
+    if (!ctx->companion_frames) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    frames            = (AVHWFramesContext*)ctx->companion_frames->data;
+    frames->format    = AV_PIX_FMT_TOPSCODEC;
+    frames->sw_format = ctx->output_pixfmt;
+    frames->width     = ctx->companion.width;
+    frames->height    = ctx->companion.height;
+    ret               = av_hwframe_ctx_init(ctx->companion_frames);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "companion av_hwframe_ctx_init failed, ret(%d)\n", ret);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    av_buffer_unref(&ctx->companion_frames);
+    if (ctx->companion_handle) {
+        ctx->topscodec_lib_ctx->lib_topscodecDecDestroy(ctx->companion_handle);
+        ctx->companion_handle = 0;
+    }
+    return ret;
+}
+
+static void topscodec_companion_destroy(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    EFBuffer*            efbuf;
+
+    while (ctx->companion_fifo && av_fifo_size(ctx->companion_fifo) > 0) {
+        av_fifo_generic_read(ctx->companion_fifo, &efbuf, sizeof(EFBuffer*), NULL);
+        ff_topscodec_efbuf_unref(efbuf);
+    }
+    if (ctx->companion_handle) {
+        ctx->topscodec_lib_ctx->lib_topscodecDecDestroy(ctx->companion_handle);
+        ctx->companion_handle = 0;
+        av_log(avctx, AV_LOG_DEBUG, "companion topscodecDecDestroy success\n");
+    }
+    /* attached companions keep their own reference */
+    av_buffer_unref(&ctx->companion_frames);
+}
+
+/* 0 and *out set when a companion frame was mapped */
+static int topscodec_companion_map(AVCodecContext* avctx, EFBuffer** out) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    EFBuffer*            efbuf;
+    int                  ret;
+
+    efbuf = topscodec_efbuf_get(avctx, ctx->companion_handle);
+    if (!efbuf) return AVERROR(ENOMEM);
+
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecFrameMap(ctx->companion_handle, &efbuf->ef_frame);
+    if (TOPSCODEC_SUCCESS != ret) {
+        ff_topscodec_efbuf_release(efbuf);
+        return TOPSCODEC_ERROR_BUFFER_EMPTY == ret ? AVERROR(EAGAIN) : AVERROR(EPERM);
+    }
+    if (0 == efbuf->ef_frame.width || 0 == efbuf->ef_frame.height) {
+        ff_topscodec_efbuf_release(efbuf);
+        return AVERROR_EOF;
+    }
+    *out = efbuf;
+    return 0;
+}
+
+/* hand the slot the main handle just took to the companion handle as well */
+static int topscodec_companion_send(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx          = avctx->priv_data;
+    EFBuffer*            efbuf        = NULL;
+    int                  sleep_handle = 0;
+    int                  ret;
+
+    if (!ctx->companion_handle) return 0;
+    while ((ret = ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(ctx->companion_handle, &ctx->ef_buf_pkt->ef_pkt,
+                                                                    topscodec_stream_timeout(ctx))) ==
+           TOPSCODEC_ERROR_TIMEOUT) {
+        /* its outputs are full, keep them mapped for the frames they belong to */
+        if (topscodec_companion_map(avctx, &efbuf) == 0) {
+            if (av_fifo_space(ctx->companion_fifo) < sizeof(EFBuffer*))
+                av_fifo_grow(ctx->companion_fifo, 5 * sizeof(EFBuffer*));
+            av_fifo_generic_write(ctx->companion_fifo, &efbuf, sizeof(EFBuffer*), NULL);
+        } else {
+            sleep_wait(&sleep_handle);
+        }
+    }
+    if (TOPSCODEC_SUCCESS != ret) {
+        av_log(avctx, AV_LOG_ERROR, "companion topscodecDecodeStream failed. ret = %d\n", ret);
+        return AVERROR_EXTERNAL;
+    }
+    return 0;
+}
+
+/* put a companion back at the front of the fifo */
+static void topscodec_companion_unget(EFCodecDecContext_t* ctx, EFBuffer* efbuf) {
+    EFBuffer* tmp;
+    int       nb = av_fifo_size(ctx->companion_fifo) / sizeof(EFBuffer*);
+
+    if (av_fifo_space(ctx->companion_fifo) < sizeof(EFBuffer*))
+        av_fifo_grow(ctx->companion_fifo, 5 * sizeof(EFBuffer*));
+    av_fifo_generic_write(ctx->companion_fifo, &efbuf, sizeof(EFBuffer*), NULL);
+    /* rotate the ones that were queued before behind it */
+    while (nb-- > 0) {
+        av_fifo_generic_read(ctx->companion_fifo, &tmp, sizeof(EFBuffer*), NULL);
+        av_fifo_generic_write(ctx->companion_fifo, &tmp, sizeof(EFBuffer*), NULL);
+    }
+}
+
+/*
+ * the companion of the frame the main handle just output, matched by pts:
+ * older companions lost their frame and are dropped, a newer one is kept for
+ * its own frame. That only holds in display order, without pts or in decode
+ * order the two are paired in output order. Waits up to wait_timeout for the
+ * companion handle to catch up.
+ */
+static EFBuffer* topscodec_companion_get(AVCodecContext* avctx, int64_t pts) {
+    EFCodecDecContext_t* ctx          = avctx->priv_data;
+    EFBuffer*            efbuf        = NULL;
+    int                  sleep_handle = 0;
+    int64_t              deadline;
+    int64_t              companion_pts;
+    int                  ret;
+
+    if (!ctx->companion_handle) return NULL;
+    deadline = av_gettime_relative() + ctx->wait_timeout * 1000LL;
+    for (;;) {
+        if (av_fifo_size(ctx->companion_fifo) > 0) {
+            av_fifo_generic_read(ctx->companion_fifo, &efbuf, sizeof(EFBuffer*), NULL);
+        } else {
+            while ((ret = topscodec_companion_map(avctx, &efbuf)) == AVERROR(EAGAIN) &&
+                   av_gettime_relative() < deadline)
+                sleep_wait(&sleep_handle);
+            if (ret < 0) {
+                av_log(avctx, AV_LOG_WARNING, "no companion frame, ret(%d)\n", ret);
+                return NULL;
+            }
+        }
+        companion_pts = (int64_t)efbuf->ef_frame.pts;
+        if (pts == AV_NOPTS_VALUE || companion_pts == pts) return efbuf;
+        if (companion_pts > pts) {
+            /* the front of the fifo again, it is older than everything mapped later */
+            av_log(avctx, AV_LOG_DEBUG, "no companion for pts:%" PRId64 ", next one is pts:%" PRId64 "\n", pts,
+                   companion_pts);
+            topscodec_companion_unget(ctx, efbuf);
+            return NULL;
+        }
+        av_log(avctx, AV_LOG_DEBUG, "drop stale companion pts:%" PRId64 " for frame pts:%" PRId64 "\n", companion_pts,
+               pts);
+        ff_topscodec_efbuf_unref(efbuf);
+    }
+}
+
+/* sampling has to stay the same on both handles, or the frames no longer pair up */
+static void topscodec_companion_update(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    topscodecDecParams_t params;
+    int                  ret;
+
+    if (!ctx->companion_handle || topscodec_companion_params(avctx, &params) < 0) return;
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(ctx->companion_handle, &params);
+    if (TOPSCODEC_SUCCESS != ret)
+        av_log(avctx, AV_LOG_WARNING, "companion topscodecDecSetParams failed, ret(%d)\n", ret);
+}
+
+/* frame holds the reference buf from now on, buf is consumed even on failure, NULL fails */
+static int topscodec_frame_hold_buf(AVFrame* frame, AVBufferRef* buf) {
+    AVBufferRef** bufs;
+
+    if (!buf) return AVERROR(ENOMEM);
+    bufs = av_realloc_array(frame->extended_buf, frame->nb_extended_buf + 1, sizeof(*bufs));
+    if (!bufs) {
+        av_buffer_unref(&buf);
+        return AVERROR(ENOMEM);
+    }
+    frame->extended_buf                           = bufs;
+    frame->extended_buf[frame->nb_extended_buf++] = buf;
+    return 0;
+}
+
+/*
+ * the companion goes into the AV_FRAME_DATA_TOPSCODEC_COMPANION side data as a plain
+ * AVTOPSCodecCompanion, so copying the props never copies a reference. Its planes and
+ * frames context are held by extended_buf of avframe, which references of the frame share.
+ */
+static void topscodec_companion_attach(AVCodecContext* avctx, AVFrame* avframe, EFBuffer* efbuf) {
+    EFCodecDecContext_t*  ctx  = avctx->priv_data;
+    AVFrame*              view = av_frame_alloc();
+    AVFrameSideData*      sd   = NULL;
+    AVTOPSCodecCompanion* companion;
+    int                   ret = view ? ff_topscodec_efbuf_to_companion(efbuf, view) : AVERROR(ENOMEM);
+    int                   i;
+
+    ff_topscodec_efbuf_unref(efbuf);
+    if (ret < 0) goto fail;
+    sd = av_frame_new_side_data(avframe, AV_FRAME_DATA_TOPSCODEC_COMPANION, sizeof(*companion));
+    if (!sd) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    companion = (AVTOPSCodecCompanion*)sd->data;
+    memset(companion, 0, sizeof(*companion));
+    for (i = 0; i < FF_ARRAY_ELEMS(companion->data) && view->buf[i]; i++) {
+        companion->data[i]     = view->data[i];
+        companion->linesize[i] = view->linesize[i];
+        ret                    = topscodec_frame_hold_buf(avframe, view->buf[i]);
+        view->buf[i]           = NULL;
+        if (ret < 0) goto fail;
+    }
+    companion->format = view->format;
+    companion->width  = view->width;
+    companion->height = view->height;
+    companion->pts    = view->pts;
+    companion->frames = (AVHWFramesContext*)ctx->companion_frames->data;
+    ret = topscodec_frame_hold_buf(avframe, av_buffer_ref(ctx->companion_frames));
+    if (ret < 0) goto fail;
+    av_frame_free(&view);
+    return;
+
+fail:
+    av_log(avctx, AV_LOG_WARNING, "companion frame not attached, ret(%d)\n", ret);
+    if (sd) av_frame_remove_side_data(avframe, AV_FRAME_DATA_TOPSCODEC_COMPANION);
+    av_frame_free(&view);
+}
+
+/*
+ * Idle sync sessions kept across close/open, keyed by everything that went
+ * into topscodecDecCreate/SetParams plus the stream buffer layout. Only a
+ * session that ran to EOS is pooled, its handle is replaced by a fresh one
+ * on the way in so no decoder state carries over to the next stream. Each
+ * entry keeps the library and its device context alive, and goes once its
+ * idle deadline passed, checked on every close and whenever the pool is used.
+ */
+typedef struct {
+    topscodecDecCreateInfo_t codec_info;
+    topscodecDecParams_t     params;
+    int                      stream_slot_num;
+    int                      stream_buf_mode;
+    topscodecHandle_t        handle;
+    u64_t                    stream_base;
+    u64_t                    mem_base;
+    u32_t                    stream_buf_size;
+    AVBufferRef*             hwdevice;
+    TopsCodecFunctions*      lib;
+    int64_t                  expire;
+} EFPooledSession;
+
+static EFPooledSession g_session_pool[TOPSCODEC_SESSION_POOL_MAX];
+static int             g_session_pool_nb    = 0;
+static pthread_mutex_t g_session_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Decoders that bring no hw_frames_ctx share one device context per card.
+ * The cache holds its reference only while some decoder uses the card, the
+ * last one to close drops it and the context goes with the last frame.
+ */
+static struct {
+    AVBufferRef* ref;
+    int          users;
+} g_device_cache[MAX_DEVICE_ID + 1];
+static pthread_mutex_t g_device_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int topscodec_device_acquire(AVCodecContext* avctx, const char* card_idx) {
+    EFCodecDecContext_t*      ctx          = avctx->priv_data;
+    AVTOPSCodecDeviceContext* device_hwctx = NULL;
+    AVBufferRef*              device       = NULL;
+    AVDictionary*             opts         = NULL;
+    int                       created      = 0;
+    int                       ret          = 0;
+
+    if (ctx->card_id < 0 || ctx->card_id > MAX_DEVICE_ID) {
+        av_log(avctx, AV_LOG_ERROR, "Error, invalid card_id %d\n", ctx->card_id);
+        return AVERROR(EINVAL);
+    }
+    pthread_mutex_lock(&g_device_cache_mutex);
+    while (!g_device_cache[ctx->card_id].ref) {
+        if (device) {
+            g_device_cache[ctx->card_id].ref = device;
+            device                           = NULL;
+            created                          = 1;
+            break;
+        }
+        /*
+         * created without the lock, decoders on the other cards do not wait
+         * for it. The first decoder on the card sets the budget of the shared
+         * context.
+         */
+        pthread_mutex_unlock(&g_device_cache_mutex);
+        if (ctx->mem_budget > 0) {
+            av_dict_set_int(&opts, "mem_budget", ctx->mem_budget, 0);
+            av_dict_set_int(&opts, "mem_wait", ctx->mem_wait, 0);
+        }
+        ret = av_hwdevice_ctx_create(&device, AV_HWDEVICE_TYPE_TOPSCODEC, card_idx, opts, 0);
+        av_dict_free(&opts);
+        if (ret < 0) return ret;
+        pthread_mutex_lock(&g_device_cache_mutex);
+    }
+    ctx->hwdevice = av_buffer_ref(g_device_cache[ctx->card_id].ref);
+    if (ctx->hwdevice)
+        g_device_cache[ctx->card_id].users++;
+    else if (created)
+        av_buffer_unref(&g_device_cache[ctx->card_id].ref);
+    pthread_mutex_unlock(&g_device_cache_mutex);
+    /* another decoder cached a context for the card meanwhile, ours goes */
+    av_buffer_unref(&device);
+    if (!ctx->hwdevice) return AVERROR(ENOMEM);
+    ctx->hwdevice_card = ctx->card_id;
+
+    if (!created) {
+        /* topsSetDevice() is per thread, the cached context was created on another one */
+        device_hwctx = ((AVHWDeviceContext*)ctx->hwdevice->data)->hwctx;
+        ret          = device_hwctx->topsruntime_lib_ctx->lib_topsSetDevice(ctx->hwdevice_card);
+        if (ret != 0) {
+            av_log(avctx, AV_LOG_ERROR, "Error, topsSetDevice[%d] failed, ret(%d)\n", ctx->hwdevice_card, ret);
+            return AVERROR(EINVAL);
+        }
+        av_log(avctx, AV_LOG_DEBUG, "shared device context of card %d\n", ctx->hwdevice_card);
+    }
+    return 0;
+}
+
+static void topscodec_device_release(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+
+    if (ctx->hwdevice_card < 0) return;
+    pthread_mutex_lock(&g_device_cache_mutex);
+    if (--g_device_cache[ctx->hwdevice_card].users == 0) av_buffer_unref(&g_device_cache[ctx->hwdevice_card].ref);
+    pthread_mutex_unlock(&g_device_cache_mutex);
+    ctx->hwdevice_card = -1;
+}
+
+static void topscodec_pooled_session_free(EFPooledSession* s) {
+    AVTOPSCodecDeviceContext* device_hwctx = ((AVHWDeviceContext*)s->hwdevice->data)->hwctx;
+
+    s->lib->lib_topscodecDecDestroy(s->handle);
+    device_hwctx->topsruntime_lib_ctx->lib_topsFree((void*)s->stream_base);
+    av_topscodec_mem_release((AVHWDeviceContext*)s->hwdevice->data, AV_TOPSCODEC_MEM_STREAM,
+                             (int64_t)s->stream_buf_size * s->stream_slot_num);
+    av_buffer_unref(&s->hwdevice);
+    topscodec_lib_release(&s->lib);
+}
+
+/* move the expired entries to out, then the oldest ones until fewer than limit are left */
+static int topscodec_session_pool_expire(EFPooledSession* out, int limit) {
+    int64_t now = av_gettime_relative();
+    int     nb  = 0;
+    int     oldest;
+    int     i;
+
+    for (i = 0; i < g_session_pool_nb;) {
+        if (g_session_pool[i].expire <= now) {
+            out[nb++]         = g_session_pool[i];
+            g_session_pool[i] = g_session_pool[--g_session_pool_nb];
+        } else {
+            i++;
+        }
+    }
+    while (g_session_pool_nb >= limit && g_session_pool_nb > 0) {
+        oldest = 0;
+        for (i = 1; i < g_session_pool_nb; i++)
+            if (g_session_pool[i].expire < g_session_pool[oldest].expire) oldest = i;
+        out[nb++]              = g_session_pool[oldest];
+        g_session_pool[oldest] = g_session_pool[--g_session_pool_nb];
+    }
+    return nb;
+}
+
+/* free the entries whose idle deadline passed, then the oldest ones until fewer than limit are left */
+static void topscodec_session_pool_trim(int limit) {
+    EFPooledSession expired[TOPSCODEC_SESSION_POOL_MAX];
+    int             nb_expired;
+    int             i;
+
+    pthread_mutex_lock(&g_session_pool_mutex);
+    nb_expired = topscodec_session_pool_expire(expired, limit);
+    pthread_mutex_unlock(&g_session_pool_mutex);
+    for (i = 0; i < nb_expired; i++) topscodec_pooled_session_free(&expired[i]);
+}
+
+/* the memory budget of device_ctx is exceeded, its idle sessions give their stream buffers back */
+static void topscodec_session_pool_reclaim(AVHWDeviceContext* device_ctx) {
+    EFPooledSession freed[TOPSCODEC_SESSION_POOL_MAX];
+    int             nb = 0;
+    int             i;
+
+    pthread_mutex_lock(&g_session_pool_mutex);
+    for (i = 0; i < g_session_pool_nb;) {
+        if (g_session_pool[i].hwdevice->data == (uint8_t*)device_ctx) {
+            freed[nb++]       = g_session_pool[i];
+            g_session_pool[i] = g_session_pool[--g_session_pool_nb];
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&g_session_pool_mutex);
+    /* the caller of the reservation holds its own reference to device_ctx */
+    for (i = 0; i < nb; i++) topscodec_pooled_session_free(&freed[i]);
+    if (nb) av_log(device_ctx, AV_LOG_VERBOSE, "%d idle sessions freed for the memory budget\n", nb);
+}
+
+/*
+ * take an idle session matching this decoder, its handle and stream buffer become ours,
+ * slot_size is the size of the slots a fresh session would allocate
+ */
+static int topscodec_session_pool_take(AVCodecContext* avctx, u32_t slot_size) {
+    EFCodecDecContext_t*     ctx = avctx->priv_data;
+    EFPooledSession          expired[TOPSCODEC_SESSION_POOL_MAX];
+    EFPooledSession          found = {0};
+    topscodecDecCreateInfo_t codec_info;
+    topscodecDecParams_t     params;
+    int                      nb_expired;
+    int                      hit = 0;
+    int                      i;
+
+    if (ctx->session_pool <= 0 || ctx->callback) return 0;
+    topscodec_fill_create_info(avctx, &codec_info);
+    if (topscodec_fill_params(avctx, &params) < 0) return 0;
+
+    pthread_mutex_lock(&g_session_pool_mutex);
+    nb_expired = topscodec_session_pool_expire(expired, INT_MAX);
+    for (i = 0; i < g_session_pool_nb; i++) {
+        if (g_session_pool[i].stream_slot_num == ctx->input_buf_num + 1 &&
+            g_session_pool[i].stream_buf_mode == ctx->stream_buf_mode &&
+            g_session_pool[i].stream_buf_size >= slot_size &&
+            !memcmp(&g_session_pool[i].codec_info, &codec_info, sizeof(codec_info)) &&
+            !memcmp(&g_session_pool[i].params, &params, sizeof(params))) {
+            found             = g_session_pool[i];
+            g_session_pool[i] = g_session_pool[--g_session_pool_nb];
+            hit               = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_session_pool_mutex);
+    for (i = 0; i < nb_expired; i++) topscodec_pooled_session_free(&expired[i]);
+    if (!hit) return 0;
+
+    ctx->handle          = found.handle;
+    ctx->stream_slot_num = found.stream_slot_num;
+    ctx->stream_buf_size = found.stream_buf_size;
+    ctx->stream_base     = found.stream_base;
+    ctx->mem_base        = found.mem_base;
+    ctx->stream_slot     = 0;
+    ctx->stream_addr     = ctx->stream_base;
+    ctx->mem_addr        = ctx->mem_base;
+    ctx->skip_frame      = avctx->skip_frame;
+    topscodec_pp_snapshot(ctx);
+    /* the stream buffer is already there, move its accounting even past the budget */
+    if (found.hwdevice->data != ctx->hwdevice->data) {
+        av_topscodec_mem_release((AVHWDeviceContext*)found.hwdevice->data, AV_TOPSCODEC_MEM_STREAM,
+                                 (int64_t)found.stream_buf_size * found.stream_slot_num);
+        av_topscodec_mem_reserve((AVHWDeviceContext*)ctx->hwdevice->data, AV_TOPSCODEC_MEM_STREAM,
+                                 (int64_t)found.stream_buf_size * found.stream_slot_num, AV_TOPSCODEC_MEM_FORCE);
+    }
+    /* this decoder holds its own references to both */
+    av_buffer_unref(&found.hwdevice);
+    topscodec_lib_release(&found.lib);
+    av_log(avctx, AV_LOG_DEBUG, "session pool hit, handle:%p\n", ctx->handle);
+    return 1;
 }
 
-static int get_card_id_from_env() {
-    char* card_id_str = getenv("TOPSCODEC_CARD_ID");
-    if (card_id_str == NULL) {
+/*
+ * hand a fresh handle and the stream buffer to the pool, 0 when this session is not poolable,
+ * the handle that ran to EOS is destroyed either way
+ */
+static int topscodec_session_pool_put(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    EFPooledSession      expired[TOPSCODEC_SESSION_POOL_MAX];
+    EFPooledSession      s = {0};
+    int                  nb_expired;
+    int                  i;
+
+    if (ctx->session_pool <= 0 || ctx->callback || !ctx->handle || !ctx->stream_base || !ctx->hwdevice ||
+        !atomic_load(&ctx->recv_outport_eos) || ff_topscodec_ring_count(&ctx->mid_frame_ring) > 0) {
+        topscodec_session_pool_trim(TOPSCODEC_SESSION_POOL_MAX);
         return 0;
     }
-    return atoi(card_id_str);
+    if (topscodec_lib_acquire(&s.lib) < 0) return 0;
+    s.hwdevice = av_buffer_ref(ctx->hwdevice);
+    if (!s.hwdevice) {
+        topscodec_lib_release(&s.lib);
+        return 0;
+    }
+    topscodec_fill_create_info(avctx, &s.codec_info);
+    if (topscodec_fill_params(avctx, &s.params) < 0) goto fail;
+    /* reset: the pool never hands out a handle that has seen a stream, the next open stays cheap */
+    topscodec_destroy_handle(avctx);
+    if (topscodec_open_handle(avctx, &s.handle, &s.codec_info, &s.params) < 0) {
+        if (s.handle) ctx->topscodec_lib_ctx->lib_topscodecDecDestroy(s.handle);
+        goto fail;
+    }
+    s.stream_slot_num = ctx->stream_slot_num;
+    s.stream_buf_mode = ctx->stream_buf_mode;
+    s.stream_base     = ctx->stream_base;
+    s.mem_base        = ctx->mem_base;
+    s.stream_buf_size = ctx->stream_buf_size;
+    s.expire          = av_gettime_relative() + ctx->session_pool_idle * 1000LL;
+
+    /* the pooled stream buffer stays accounted on the device, which may take it back under pressure */
+    av_topscodec_mem_set_reclaim((AVHWDeviceContext*)s.hwdevice->data, topscodec_session_pool_reclaim);
+    pthread_mutex_lock(&g_session_pool_mutex);
+    nb_expired                          = topscodec_session_pool_expire(expired, ctx->session_pool);
+    g_session_pool[g_session_pool_nb++] = s;
+    pthread_mutex_unlock(&g_session_pool_mutex);
+    for (i = 0; i < nb_expired; i++) topscodec_pooled_session_free(&expired[i]);
+
+    av_log(avctx, AV_LOG_DEBUG, "session pool put, handle:%p\n", s.handle);
+    ctx->stream_base = 0;
+    ctx->stream_addr = 0;
+    return 1;
+
+fail:
+    av_buffer_unref(&s.hwdevice);
+    topscodec_lib_release(&s.lib);
+    return 0;
 }
 
-static int get_device_id_from_env() {
-    char* device_id_str = getenv("TOPSCODEC_DEVICE_ID");
-    if (device_id_str == NULL) {
-        return 0;
+/*
+ * validate the crop/resize/rotation options against the input size, out_width/out_height
+ * come in as the size without post processing and leave as the size of the output frames
+ */
+static int topscodec_check_pp(AVCodecContext* avctx, int* out_width, int* out_height) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    int                  tmp;
+
+    if (ctx->enable_crop) {
+        av_log(avctx, AV_LOG_DEBUG, "Open crop options.\n");
+        if (ctx->crop.top < 0 || ctx->crop.bottom < 0 || ctx->crop.left < 0 || ctx->crop.right < 0 ||
+            ctx->crop.top > ctx->in_height || ctx->crop.left > ctx->in_width || ctx->crop.bottom > ctx->in_height ||
+            ctx->crop.right > ctx->in_width || ctx->crop.top >= ctx->crop.bottom || ctx->crop.left >= ctx->crop.right ||
+            ctx->crop.bottom - ctx->crop.top < 8 || ctx->crop.right - ctx->crop.left < 8) {
+            av_log(avctx, AV_LOG_ERROR,
+                   "Invalid crop "
+                   "dim(lefg:%d,top:%d)(right:%d,bottom:%d)\n",
+                   ctx->crop.left, ctx->crop.top, ctx->crop.right, ctx->crop.bottom);
+            return AVERROR(EINVAL);
+        }
+        *out_width  = ctx->crop.right - ctx->crop.left;
+        *out_height = ctx->crop.bottom - ctx->crop.top;
     }
-    return atoi(device_id_str);
+
+    if (ctx->enable_resize) {
+        av_log(avctx, AV_LOG_DEBUG, "Open downscale option.\n");
+        if (ctx->resize.height < 0 || ctx->resize.width < 0 || ctx->resize.height > ctx->in_height ||
+            ctx->resize.width > ctx->in_width) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid resize dim %dx%d, only support downscale.\n", ctx->resize.width,
+                   ctx->resize.height);
+            return AVERROR(EINVAL);
+        }
+        *out_width  = ctx->resize.width;
+        *out_height = ctx->resize.height;
+    }
+
+    if (ctx->enable_rotation) {
+        if (ctx->rotation == 90 || ctx->rotation == 180 || ctx->rotation == 270) {
+            av_log(avctx, AV_LOG_DEBUG, "Open rotation option:%d.\n", ctx->rotation);
+        } else {
+            av_log(avctx, AV_LOG_ERROR, "Invalid rotaion value, only support 90/180/270\n");
+            return AVERROR(EINVAL);
+        }
+
+        if (ctx->rotation == 90 || ctx->rotation == 270) {
+            tmp         = *out_width;
+            *out_width  = *out_height;
+            *out_height = tmp;
+        }
+    }
+    return 0;
 }
 
 static int topscodec_decode_init_internel(AVCodecContext* avctx) {
@@ -362,12 +1675,7 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
     AVHWDeviceContext*        device_ctx   = NULL;
     AVTOPSCodecDeviceContext* device_hwctx = NULL;
 
-    topscodecDecCreateInfo_t codec_info            = {0};
-    topscodecDecParams_t     params                = {0};
-    topsPointerAttribute_t   att                   = {0};
-    topsError_t              tops_ret              = TOPSCODEC_SUCCESS;
-    void*                    tmp                   = NULL;
-    char                     card_idx[sizeof(int)] = {0};
+    char card_idx[sizeof(int)] = {0};
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)
     AVBSFContext* bsf = NULL;
 #endif
@@ -379,11 +1687,9 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
     int probed_height         = 0;
     int max_width             = 0;
     int max_height            = 0;
-
-    int switch_frames_mode = 0;
-    int switch_frames_num  = 0;
-    int rotation_tmp       = 0;
-    int debug_level        = 1;
+    int probed_dims           = 0;
+    int debug_level           = 1;
+    int slot_size             = 0;
 
     enum AVPixelFormat pix_fmts[3];
 
@@ -522,7 +1828,21 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
     /* sw_pix_fmt is Nominal unaccelerated pixel format.*/
     avctx->sw_pix_fmt = ctx->output_pixfmt;
     av_log(avctx, AV_LOG_DEBUG, "TOPSCODEC AVCTX sw pix fmt:%s\n", av_get_pix_fmt_name(avctx->sw_pix_fmt));
+    /* the env picks the card before the device context is created on it */
+    if (ctx->card_id == 0) {
+        ctx->card_id = get_card_id_from_env();
+        if (ctx->card_id < 0) {
+            av_log(avctx, AV_LOG_ERROR, "Error, invalid TOPSCODEC_CARD_ID %s\n", getenv("TOPSCODEC_CARD_ID"));
+            ret = AVERROR(EINVAL);
+            goto error;
+        }
+    }
+
+    if (ctx->device_id == 0) {
+        ctx->device_id = get_device_id_from_env();
+    }
     sprintf(card_idx, "%d", ctx->card_id);
+    ctx->hwdevice_card = -1;
     if (avctx->hw_frames_ctx) {  // if hw_frames_ctx setted by user
         av_buffer_unref(&ctx->hwframe);
         ctx->hwframe = av_buffer_ref(avctx->hw_frames_ctx);
@@ -542,7 +1862,7 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
             goto error;
         }
     } else {
-        ret = av_hwdevice_ctx_create(&ctx->hwdevice, AV_HWDEVICE_TYPE_TOPSCODEC, card_idx, NULL, 0);
+        ret = topscodec_device_acquire(avctx, card_idx);
         if (ret < 0) {
             av_log(avctx, AV_LOG_ERROR, "Hardware device context create failed,ret(%d).\n", ret);
             goto error;
@@ -560,36 +1880,25 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
         avctx->hw_frames_ctx  = av_buffer_ref(ctx->hwframe);
     }
 
-    pthread_mutex_lock(&g_dec_mutex);
-    ret = topscodec_load_functions(&ctx->topscodec_lib_ctx);
+    ret = topscodec_lib_acquire(&ctx->topscodec_lib_ctx);
     if (ret != 0) {
         av_log(avctx, AV_LOG_ERROR, "Error, topscodec_lib_load failed, ret(%d)\n", ret);
         ret = AVERROR(EINVAL);
-        pthread_mutex_unlock(&g_dec_mutex);
         goto error;
     }
-    pthread_mutex_unlock(&g_dec_mutex);
 
     topscodec_get_version(avctx);
     memset(&ctx->caps, 0, sizeof(ctx->caps));
-    if (ctx->card_id == 0) {
-        ctx->card_id = get_card_id_from_env();
-    }
-
-    if (ctx->device_id == 0) {
-        ctx->device_id = get_device_id_from_env();
-    }
     /*get device caps*/
     av_log(avctx, AV_LOG_DEBUG, "topscodecDecGetCaps: type[%d],card[%d]dev[%d]\n", ctx->codec_type, ctx->card_id,
            ctx->device_id);
-    ret = ctx->topscodec_lib_ctx->lib_topscodecDecGetCaps(ctx->codec_type, ctx->card_id, ctx->device_id, &ctx->caps);
+    ret = topscodec_get_caps(avctx);
     if (TOPSCODEC_SUCCESS != ret) {
         av_log(avctx, AV_LOG_ERROR, "Error, topscodecDecGetCaps failed, ret(%d)\n", ret);
         ret = AVERROR(EINVAL);
         goto error;
     }
 
-    print_caps(avctx, &ctx->caps);
     if (!ctx->caps.supported) {
         av_log(avctx, AV_LOG_ERROR, "Unsupport tops codec %s\n", avcodec_descriptor_get(avctx->codec->id)->long_name);
         return AVERROR_BUG;
@@ -598,6 +1907,7 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
     max_width  = ctx->caps.max_width;
     max_height = ctx->caps.max_height;
 
+    probed_dims   = (avctx->coded_width || avctx->width) && (avctx->coded_height || avctx->height);
     probed_width  = avctx->coded_width ? avctx->coded_width : (avctx->width ? avctx->width : max_width);
     probed_height = avctx->coded_height ? avctx->coded_height : (avctx->height ? avctx->height : max_height);
 
@@ -627,57 +1937,19 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
         return AVERROR(EINVAL);
     }
 
-    if (ctx->enable_crop) {
-        av_log(avctx, AV_LOG_DEBUG, "Open crop options.\n");
-        if (ctx->crop.top < 0 || ctx->crop.bottom < 0 || ctx->crop.left < 0 || ctx->crop.right < 0 ||
-            ctx->crop.top > avctx->height || ctx->crop.left > avctx->width || ctx->crop.bottom > avctx->height ||
-            ctx->crop.right > avctx->width || ctx->crop.top >= ctx->crop.bottom || ctx->crop.left >= ctx->crop.right ||
-            ctx->crop.bottom - ctx->crop.top < 8 || ctx->crop.right - ctx->crop.left < 8) {
-            av_log(avctx, AV_LOG_ERROR,
-                   "Invalid crop "
-                   "dim(lefg:%d,top:%d)(right:%d,bottom:%d)\n",
-                   ctx->crop.left, ctx->crop.top, ctx->crop.right, ctx->crop.bottom);
-            return AVERROR(EINVAL);
-        }
-        ctx->out_width  = ctx->crop.right - ctx->crop.left;
-        ctx->out_height = ctx->crop.bottom - ctx->crop.top;
-    }
-
-    if (ctx->enable_resize) {
-        av_log(avctx, AV_LOG_DEBUG, "Open downscale option.\n");
-        if (ctx->resize.height < 0 || ctx->resize.width < 0 || ctx->resize.height > avctx->height ||
-            ctx->resize.width > avctx->width) {
-            av_log(avctx, AV_LOG_ERROR, "Invalid resize dim %dx%d, only support downscale.\n", ctx->resize.width,
-                   ctx->resize.height);
-            return AVERROR(EINVAL);
-        }
-        ctx->out_width  = ctx->resize.width;
-        ctx->out_height = ctx->resize.height;
-    }
-
-    if (ctx->enable_rotation) {
-        if (ctx->rotation == 90 || ctx->rotation == 180 || ctx->rotation == 270) {
-            av_log(avctx, AV_LOG_DEBUG, "Open rotation option:%d.\n", ctx->rotation);
-        } else {
-            av_log(avctx, AV_LOG_ERROR, "Invalid rotaion value, only support 90/180/270\n");
-            return AVERROR(EINVAL);
-        }
-
-        if (ctx->rotation == 90 || ctx->rotation == 270) {
-            rotation_tmp    = ctx->out_width;
-            ctx->out_width  = ctx->out_height;
-            ctx->out_height = rotation_tmp;
-        }
-    }
+    ret = topscodec_check_pp(avctx, &ctx->out_width, &ctx->out_height);
+    if (ret < 0) return ret;
 
     // after getting the final output width and height, init hwframe
     if (need_init_hwframe_ctx && !hwframe_ctx->pool) {
         hwframe_ctx->format            = AV_PIX_FMT_TOPSCODEC;
         hwframe_ctx->sw_format         = avctx->sw_pix_fmt;
-        hwframe_ctx->width             = avctx->coded_width;   // outwidth? downscale
-        hwframe_ctx->height            = avctx->coded_height;  // outheight? downscale
-        hwframe_ctx->initial_pool_size = 3;                    /*TODO*/
-        hwframe_ctx->pool              = NULL;                 /*TODO*/
+        hwframe_ctx->width             = ctx->out_width;   // after crop/downscale/rotation
+        hwframe_ctx->height            = ctx->out_height;  // a new size gets a new context
+        /* every output frame is copied into a pool buffer, warm up one per output port so the
+         * first frames do not wait for device allocations, zero copy outputs the codec buffers */
+        hwframe_ctx->initial_pool_size = ctx->zero_copy ? 0 : ctx->output_buf_num;
+        hwframe_ctx->pool              = NULL;
         if ((ret = av_hwframe_ctx_init(ctx->hwframe)) < 0) {
             av_log(avctx, AV_LOG_ERROR, "Error, av_hwframe_ctx_init failed, ret(%d)\n", ret);
             ret = AVERROR(EINVAL);
@@ -690,23 +1962,34 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
     device_hwctx             = device_ctx->hwctx;
     ctx->topsruntime_lib_ctx = device_hwctx->topsruntime_lib_ctx;
 
-    ctx->total_frame_count  = 0;
-    ctx->total_packet_count = 0;
-    ctx->recv_first_frame   = 0;
-    ctx->draining           = 0;
-    ctx->recv_outport_eos   = 0;
-    ctx->first_packet       = 1;
-    ctx->idx_get            = 0;
-    ctx->idx_put            = 0;
-    ctx->count              = 0;
+    topscodec_reset_state(ctx);
 
     // for (int i = 0; i < MAX_FRAME_NUM; i++) {
     //     ctx->last_received_frame[i] = av_frame_alloc();
     // }
     // 在flush的时候创建
     // ctx->avframe_fifo = av_fifo_alloc(MAX_FRAME_NUM * sizeof(AVFrame*));
-    ctx->pkt_prop_fifo    = av_fifo_alloc(MAX_FRAME_NUM * sizeof(AVFrame*));
-    ctx->mid_avframe_fifo = av_fifo_alloc(MAX_FRAME_NUM * sizeof(AVFrame*));
+    ctx->pkt_prop_fifo = av_fifo_alloc(MAX_FRAME_NUM * sizeof(AVFrame*));
+    /* every outport buffer can be in flight at once, plus the frames already converted */
+    ret = ff_topscodec_ring_init(&ctx->mid_frame_ring, FFMAX(ctx->output_buf_num, MAX_FRAME_NUM));
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Error, mid frame ring init failed, ret(%d)\n", ret);
+        goto error;
+    }
+    av_log(avctx, AV_LOG_DEBUG, "mid frame ring size:%u\n", ctx->mid_frame_ring.size);
+
+    /*
+     * frame mode codecs need one packet per call, sampling drops frames the pts queue would not know about,
+     * and the queue hands out pts in display order, decode order output would get them sorted
+     */
+    ctx->coalesce = 0;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 100, 100)
+    ctx->coalesce = ctx->coalesce_bytes > 0 && !ctx->enable_sfo && !topscodec_decode_order(avctx) &&
+                    ctx->codec_type != TOPSCODEC_VP8 && ctx->codec_type != TOPSCODEC_VP9 &&
+                    ctx->codec_type != TOPSCODEC_AV1;
+#endif
+    av_log(avctx, AV_LOG_DEBUG, "coalesce:%d, bytes:%d, delay:%dms\n", ctx->coalesce, ctx->coalesce_bytes,
+           ctx->coalesce_delay);
 
     /*
      * At this moment, if the demuxer does not set this value
@@ -726,200 +2009,50 @@ static int topscodec_decode_init_internel(AVCodecContext* avctx) {
             break;
     }
 
-    bitstream_size = ceil((probed_width * probed_height) * 1.25);
-
-    ctx->stream_buf_size = FFALIGN(bitstream_size, 4096);
-    if (!ctx->stream_addr) {
-        tops_ret =
-            ctx->topsruntime_lib_ctx->lib_topsExtMallocWithFlags(&tmp, ctx->stream_buf_size, topsMallocHostAccessable);
-        if (topsSuccess != tops_ret) {
-            av_log(avctx, AV_LOG_ERROR, "Error, topsMalloc failed, ret(%d)\n", tops_ret);
-            ret = AVERROR(EPERM);
-            goto error;
-        }
-        ctx->stream_addr = (uint64_t)tmp;
-        av_log(avctx, AV_LOG_DEBUG, "malloc stream_addr:0x%lx\n", ctx->stream_addr);
-        tops_ret = ctx->topsruntime_lib_ctx->lib_topsPointerGetAttributes(&att, (void*)(ctx->stream_addr));
-        if (tops_ret != topsSuccess) {
-            av_log(avctx, AV_LOG_ERROR, "topsPointerGetAttributes failed!\n");
-            ret = AVERROR(EPERM);
-            goto error;
-        }
-        ctx->mem_addr = (u64_t)att.device_pointer;
-    }
-    av_log(avctx, AV_LOG_DEBUG, "zero copy %d\n", ctx->zero_copy);
-
-    memset(&codec_info, 0, sizeof(topscodecDecCreateInfo_t));
-    codec_info.device_id       = ctx->card_id;
-    codec_info.session_id      = ctx->device_id;
-    codec_info.hw_ctx_id       = ctx->hw_id;
-    codec_info.codec           = ctx->codec_type;
-    codec_info.stream_buf_size = ctx->stream_buf_size;
-    if (ctx->callback == 1) {
-        codec_info.hw_ctx_id    = 0x0F;  // hardware context id 固定值0x0F
-        codec_info.sw_ctx_id    = 0x08;  // software context id 固定值0x08
-        codec_info.run_mode     = TOPSCODEC_RUN_MODE_ASYNC;
-        codec_info.callback     = decode_callback;
-        codec_info.user_context = (u64_t)avctx;
-        av_log(avctx, AV_LOG_DEBUG, "run in async mode\n");
-    } else {
-        codec_info.run_mode     = TOPSCODEC_RUN_MODE_SYNC;
-        codec_info.callback     = NULL;
-        codec_info.user_context = 0;
-        av_log(avctx, AV_LOG_DEBUG, "run in sync mode\n");
-    }
-
-    if (codec_info.codec == TOPSCODEC_VP8 || codec_info.codec == TOPSCODEC_VP9 || codec_info.codec == TOPSCODEC_AV1) {
-        codec_info.send_mode = TOPSCODEC_DEC_SEND_MODE_FRAME;
-    } else {
-        codec_info.send_mode = TOPSCODEC_DEC_SEND_MODE_STREAM;
-    }
-
-    /*
-     * sf setting
-     */
-    switch_frames_num       = ctx->sf;
-    switch_frames_mode      = 1;
-    codec_info.reserved[9]  = switch_frames_mode;
-    codec_info.reserved[10] = switch_frames_num;
-
-#ifdef TOPS_LOG
-    /* ap log setting*/
-    codec_info.reserved[0] = 1;
-    codec_info.reserved[1] = 1;
-    /* Log level */
-    for (int i = 0; i < 7; i++) {
-        codec_info.reserved[i + 2] = 4;
-    }
-#endif
-
-    /*create codec*/
-    print_create_info(avctx, &codec_info);
-    ret = ctx->topscodec_lib_ctx->lib_topscodecDecCreate(&ctx->handle, &codec_info);
-    if (TOPSCODEC_SUCCESS != ret) {
-        av_log(avctx, AV_LOG_ERROR, "Error, topscodecDecCreate failed, ret(%d)\n", ret);
-        ret = AVERROR(EINVAL);
-        goto error;
-    }
-    av_log(avctx, AV_LOG_DEBUG, "topscodecDecCreate successful, handle:0x%p\n", ctx->handle);
-    memset(&params, 0, sizeof(topscodecDecParams_t));
-    params.pixel_format = avpixfmt_2_topspixfmt(ctx->output_pixfmt);
-    av_log(avctx, AV_LOG_DEBUG, "Out pixfmt: (%d)%s\n", params.pixel_format,
-           av_pix_fmt_desc_get(ctx->output_pixfmt)->name);
-
-    params.color_space = str_2_topsolorspace(ctx->color_space);
-    av_log(avctx, AV_LOG_DEBUG, "Out Colorspace: %s\n", ctx->color_space);
-
-    params.reserved[4] = ctx->input_buf_num;
-    av_log(avctx, AV_LOG_DEBUG, "input_buf_num: %d\n", ctx->input_buf_num);
-
-    params.output_buf_num = ctx->output_buf_num;
-    av_log(avctx, AV_LOG_DEBUG, "output_buf_num: %d\n", ctx->output_buf_num);
-
-    if (ctx->enable_crop && ctx->enable_rotation) {
-        av_log(avctx, AV_LOG_ERROR,
-               "Set Parameter error, Rotation and Crop "
-               "can not be set at the same time. \n");
-        ret = AVERROR(EINVAL);
-        goto error;
-    }
-
-    if (ctx->enable_crop && ctx->enable_resize) {
-        av_log(avctx, AV_LOG_ERROR,
-               "Set Parameter error, Downscale resize "
-               "and Crop can not be set at the same time. \n");
-        ret = AVERROR(EINVAL);
-        goto error;
-    }
-
-    if (ctx->enable_sfo && (ctx->sfo * ctx->sf_idr != 0)) {
-        av_log(avctx, AV_LOG_ERROR,
-               "Set Parameter error, Frame sampling"
-               " interval and IDR Frame sampling can not be set at the same "
-               "time.\n");
-        ret = AVERROR(EINVAL);
-        goto error;
-    }
-
-    if (ctx->enable_resize) {
-        params.pp_attr.downscale.enable = 1;
-        params.pp_attr.downscale.width  = ctx->resize.width;
-        params.pp_attr.downscale.height = ctx->resize.height;
-        /*!< Downscale mode: 0-Bilinear, 1-Nearest*/
-        params.pp_attr.downscale.interDslMode = ctx->resize.mode;
-        av_log(avctx, AV_LOG_DEBUG, "Setting resize, %dx%d->%dx%d.\n", avctx->width, avctx->height, ctx->resize.width,
-               ctx->resize.height);
-    }
-
-    /* Set Crop Parameter */
-    if (ctx->enable_crop) {
-        params.pp_attr.crop.enable = 1;
-        params.pp_attr.crop.tl_x   = ctx->crop.left;
-        params.pp_attr.crop.tl_y   = ctx->crop.top;
-        params.pp_attr.crop.br_x   = ctx->crop.right;
-        params.pp_attr.crop.br_y   = ctx->crop.bottom;
-        av_log(avctx, AV_LOG_DEBUG,
-               "Setting crop,src dim:(%dx%d),crop dim:"
-               "((left,top)(right,bottom)):"
-               "((%dx%d),(%dx%d))\n",
-               avctx->width, avctx->height, ctx->crop.left, ctx->crop.top, ctx->crop.right, ctx->crop.bottom);
-    }
-
-    /* Set Rotation Parameter */
-    if (ctx->enable_rotation) {
-        params.pp_attr.rotation.enable = 1;
-        switch (ctx->rotation) {
-            case 90:
-                params.pp_attr.rotation.rotation = TOPSCODEC_ROTATION_90;
-                break;
-            case 180:
-                params.pp_attr.rotation.rotation = TOPSCODEC_ROTATION_180;
-                break;
-            case 270:
-                params.pp_attr.rotation.rotation = TOPSCODEC_ROTATION_270;
-                break;
-            default:
-                break;
-        }
-        av_log(avctx, AV_LOG_DEBUG, "Setting rotation, rotation:%d\n", ctx->rotation);
-    }
-
-    if (ctx->enable_sfo) {
-        params.pp_attr.sf.enable = 1;
-        if (ctx->sfo != 0)
-            params.pp_attr.sf.sfo = ctx->sfo;
-        else if (ctx->sf_idr != 0)
-            params.pp_attr.sf.sf_idr = FF_IDR_MAGIC;
+    bitstream_size = ceil((probed_width * probed_height) * 1.25);
 
-        av_log(avctx, AV_LOG_DEBUG, "Setting sampling interval value, sfo:%d,sf_idr:%d\n", ctx->sfo, FF_IDR_MAGIC);
+    ctx->stream_buf_max = FFALIGN(bitstream_size, 4096);
+    if (ctx->stream_buf_mode == TOPSCODEC_STREAM_BUF_ADAPTIVE)
+        slot_size = topscodec_stream_buf_estimate(avctx, probed_dims);
+    else
+        slot_size = ctx->stream_buf_max;
+    if (!ctx->stream_base) topscodec_session_pool_take(avctx, slot_size);
+    if (!ctx->stream_base) {
+        /*
+         * the codec keeps up to in_port_num packets queued and reads them from
+         * our buffer, one extra slot is the one we upload into meanwhile
+         */
+        ctx->stream_slot_num = ctx->input_buf_num + 1;
+        ret                  = topscodec_stream_buf_alloc(avctx, slot_size);
+        if (ret < 0) goto error;
     }
+    av_log(avctx, AV_LOG_DEBUG, "zero copy %d\n", ctx->zero_copy);
 
-    /*set codec params*/
-    av_usleep(1000);
-    print_param(avctx, &params);
-    av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams, handle:%p\n", ctx->handle);
-    ret = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(ctx->handle, &params);
-    if (TOPSCODEC_SUCCESS != ret) {
-        av_log(avctx, AV_LOG_ERROR, "Error, topscodecDecSetParams failed, ret(%d)\n", ret);
-        ret = AVERROR(EINVAL);
-        goto error;
+    if (!ctx->handle) {
+        ret = topscodec_create_handle(avctx);
+        if (ret < 0) goto error;
     }
-    av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams success\n");
+    ret = topscodec_companion_create(avctx);
+    if (ret < 0) goto error;
+
     ctx->ef_buf_pkt = av_malloc(sizeof(EFBuffer));
     memset(ctx->ef_buf_pkt, 0, sizeof(EFBuffer));
     ctx->ef_buf_pkt->avctx            = avctx;
     ctx->ef_buf_pkt->ef_context       = ctx;
     ctx->ef_buf_pkt->ef_pkt.mem_addr  = 0;
     ctx->ef_buf_pkt->ef_pkt.alloc_len = 0;
-    for (int i = 0; i < MAX_FRAME_NUM; i++) {
-        ctx->ef_buf_frame[i] = av_malloc(sizeof(EFBuffer));
-        memset(ctx->ef_buf_frame[i], 0, sizeof(EFBuffer));
-        ctx->ef_buf_frame[i]->avctx      = avctx;
-        ctx->ef_buf_frame[i]->ef_context = ctx;
+    ctx->ef_buf_pool = av_buffer_pool_init(sizeof(EFBuffer), NULL);
+    if (!ctx->ef_buf_pool) {
+        av_log(avctx, AV_LOG_ERROR, "Error, EFBuffer pool init failed\n");
+        ret = AVERROR(ENOMEM);
+        goto error;
     }
 
-    if (!avctx->pkt_timebase.num || !avctx->pkt_timebase.den)
+    if (!avctx->pkt_timebase.num || !avctx->pkt_timebase.den) {
         av_log(avctx, AV_LOG_DEBUG, "Invalid pkt_timebase, passing timestamps as-is.\n");
+        if (ctx->out_fps.num)
+            av_log(avctx, AV_LOG_WARNING, "out_fps needs pkt_timebase, all frames are output.\n");
+    }
 
     ctx->decoder_init_flag = 1;
     av_log(avctx, AV_LOG_DEBUG, "Thread: %lu, decoder init done\n", (long unsigned)pthread_self());
@@ -931,9 +2064,22 @@ error:
 
 static av_cold int topscodec_decode_init(AVCodecContext* avctx) {
     EFCodecDecContext_t* ctx = NULL;
+    int                  ret = 0;
     ctx                      = avctx->priv_data;
     ctx->avframe_fifo        = av_fifo_alloc(MAX_FRAME_NUM * sizeof(AVFrame*));
     av_log(avctx, AV_LOG_DEBUG, "flush fifo queue alloc.\n");
+    ret = ff_topscodec_frame_pool_init(&ctx->frame_pool, FFMAX(ctx->input_buf_num, ctx->output_buf_num));
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Error, frame pool init failed, ret(%d)\n", ret);
+        return ret;
+    }
+    ret = topscodec_event_init(ctx);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Error, event init failed, ret(%d)\n", ret);
+        return ret;
+    }
+    av_log(avctx, AV_LOG_DEBUG, "wait mode: %s, wait timeout: %dms\n",
+           ctx->wait_mode == TOPSCODEC_WAIT_EVENT ? "event" : "poll", ctx->wait_timeout);
     return topscodec_decode_init_internel(avctx);
 }
 
@@ -948,38 +2094,40 @@ static int topscodec_decode_close_internel(AVCodecContext* avctx) {
 #endif
     if (ctx->av_pkt) av_packet_free(&ctx->av_pkt);
 
-    if (ctx->handle) {
-        /*destory codec dec*/
-        ctx->topscodec_lib_ctx->lib_topscodecDecDestroy(ctx->handle);
-        ctx->handle = 0;
-        av_log(avctx, AV_LOG_DEBUG, "topscodecDecDestroy success\n");
-    }
-
-    if (ctx->stream_addr) {
-        ctx->topsruntime_lib_ctx->lib_topsFree((void*)ctx->stream_addr);
+    /* a session that ran to EOS may go to the pool instead, with its stream buffer */
+    topscodec_companion_destroy(avctx);
+    topscodec_session_pool_put(avctx);
+    topscodec_ring_drain(avctx);
+    topscodec_destroy_handle(avctx);
+    av_fifo_freep(&ctx->companion_fifo);
+
+    topscodec_stream_buf_free_retired(ctx);
+    if (ctx->stream_base) {
+        ctx->topsruntime_lib_ctx->lib_topsFree((void*)ctx->stream_base);
+        topscodec_stream_mem_release(ctx, (int64_t)ctx->stream_buf_size * ctx->stream_slot_num);
+        ctx->stream_base = 0;
         ctx->stream_addr = 0;
-        av_log(avctx, AV_LOG_DEBUG, "topsFree stream_addr success\n");
+        av_log(avctx, AV_LOG_DEBUG, "topsFree stream_addr success, high-water mark %" PRId64 " of %u\n",
+               ctx->stream_buf_hwm, ctx->stream_buf_size);
     }
 
     if (ctx->ef_buf_pkt) {
         av_free(ctx->ef_buf_pkt);
         av_log(avctx, AV_LOG_DEBUG, "ef_buf_pkt free\n");
     }
-    for (int i = 0; i < MAX_FRAME_NUM; i++) {
-        if (ctx->ef_buf_frame[i]) {
-            av_free(ctx->ef_buf_frame[i]);
-            av_log(avctx, AV_LOG_DEBUG, "ef_buf_frame[%d] free\n", i);
-        }
+    if (ctx->ef_buf_pool) {
+        /* the pool is freed once the frames still held by the caller are released */
+        av_buffer_pool_uninit(&ctx->ef_buf_pool);
+        av_log(avctx, AV_LOG_DEBUG, "ef_buf_pool uninit\n");
     }
 
     if (ctx->topscodec_lib_ctx) {
-        pthread_mutex_lock(&g_dec_mutex);
-        topscodec_free_functions(&ctx->topscodec_lib_ctx);
-        av_log(avctx, AV_LOG_DEBUG, "topscodec_free_functions success\n");
-        pthread_mutex_unlock(&g_dec_mutex);
+        topscodec_lib_release(&ctx->topscodec_lib_ctx);
+        av_log(avctx, AV_LOG_DEBUG, "topscodec_lib_release success\n");
     }
 
     if (ctx->hwdevice) {
+        topscodec_device_release(avctx);
         av_buffer_unref(&ctx->hwdevice);
         av_log(avctx, AV_LOG_DEBUG, "hwdevice unref\n");
     }
@@ -1000,23 +2148,16 @@ static int topscodec_decode_close_internel(AVCodecContext* avctx) {
             av_fifo_generic_read(ctx->pkt_prop_fifo, &avframe_tmp, sizeof(AVFrame*), NULL);
             av_log(avctx, AV_LOG_DEBUG, "close fifo [%p] Get frame ,size:%d\n", avframe_tmp,
                    av_fifo_size(ctx->pkt_prop_fifo));
-            av_frame_unref(avframe_tmp);
-            av_frame_free(&avframe_tmp);
+            ff_topscodec_frame_pool_put(&ctx->frame_pool, avframe_tmp);
         }
         av_fifo_freep(&ctx->pkt_prop_fifo);
     }
 
-    if (ctx->mid_avframe_fifo) {
-        while (av_fifo_size(ctx->mid_avframe_fifo) > 0) {
-            AVFrame* avframe_tmp;
-            av_fifo_generic_read(ctx->mid_avframe_fifo, &avframe_tmp, sizeof(AVFrame*), NULL);
-            av_log(avctx, AV_LOG_DEBUG, "close fifo [%p] Get frame ,size:%d\n", avframe_tmp,
-                   av_fifo_size(ctx->mid_avframe_fifo));
-            av_frame_unref(avframe_tmp);
-            av_frame_free(&avframe_tmp);
-        }
-        av_fifo_freep(&ctx->mid_avframe_fifo);
+    if (ctx->mid_frame_ring.slots) {
+        av_log(avctx, AV_LOG_DEBUG, "close ring, drop %u frames\n", ff_topscodec_ring_count(&ctx->mid_frame_ring));
+        ff_topscodec_ring_uninit(&ctx->mid_frame_ring);
     }
+    ff_topscodec_pts_queue_uninit(&ctx->coalesce_pts);
     ctx->decoder_init_flag = 0;
     av_log(avctx, AV_LOG_DEBUG, "Thread, %lu, decode close \n", (long unsigned)pthread_self());
     return 0;
@@ -1024,23 +2165,32 @@ static int topscodec_decode_close_internel(AVCodecContext* avctx) {
 
 static av_cold int topscodec_decode_close(AVCodecContext* avctx) {
     EFCodecDecContext_t* ctx = NULL;
+    int                  ret = 0;
     ctx                      = avctx->priv_data;
     while (av_fifo_size(ctx->avframe_fifo) > 0) {
         AVFrame* avframe_tmp;
         av_fifo_generic_read(ctx->avframe_fifo, &avframe_tmp, sizeof(AVFrame*), NULL);
         av_log(avctx, AV_LOG_DEBUG, "close fifo [%p] Get frame ,size:%d\n", avframe_tmp,
                av_fifo_size(ctx->avframe_fifo));
-        av_frame_unref(avframe_tmp);
-        av_frame_free(&avframe_tmp);
+        ff_topscodec_frame_pool_put(&ctx->frame_pool, avframe_tmp);
     }
     av_fifo_freep(&ctx->avframe_fifo);
     av_log(avctx, AV_LOG_DEBUG, "flush fifo queue freep.\n");
-    return topscodec_decode_close_internel(avctx);
+    ret = topscodec_decode_close_internel(avctx);
+    /* in the steady state every get is served from the free list */
+    av_log(avctx, AV_LOG_DEBUG, "frame pool: gets:%u, allocs:%u, preallocated:%d\n", ctx->frame_pool.nb_gets,
+           ctx->frame_pool.nb_allocs, FFMAX(ctx->input_buf_num, ctx->output_buf_num));
+    ff_topscodec_frame_pool_uninit(&ctx->frame_pool);
+    topscodec_event_uninit(ctx);
+    return ret;
 }
 
 static int topscodec_recived_helper(AVCodecContext* avctx, AVFrame* avframe, int is_internel, int is_flush) {
-    int ret = 0;
-    int idx = 0;
+    int       ret         = 0;
+    AVFrame*  avframe_tmp = NULL;
+    EFBuffer* efbuf       = NULL;
+    EFBuffer* companion   = NULL;
+    int64_t   pts;
 
     EFCodecDecContext_t* ctx = (EFCodecDecContext_t*)avctx->priv_data;
     av_frame_unref(avframe);  // fix me
@@ -1051,8 +2201,8 @@ static int topscodec_recived_helper(AVCodecContext* avctx, AVFrame* avframe, int
         av_log(avctx, AV_LOG_DEBUG, "flush fifo [%p] Get frame ,size:%d\n", avframe_tmp,
                av_fifo_size(ctx->avframe_fifo));
 
-        av_frame_ref(avframe, avframe_tmp);
-        av_frame_free(&avframe_tmp);
+        av_frame_move_ref(avframe, avframe_tmp);
+        ff_topscodec_frame_pool_put(&ctx->frame_pool, avframe_tmp);
         return 0;
     }
 
@@ -1065,62 +2215,87 @@ static int topscodec_recived_helper(AVCodecContext* avctx, AVFrame* avframe, int
     //     return 0;
     // }
 
-    if (is_internel != 1 && av_fifo_size(ctx->mid_avframe_fifo) > 0) {
-        AVFrame* avframe_tmp;
-        av_fifo_generic_read(ctx->mid_avframe_fifo, &avframe_tmp, sizeof(AVFrame*), NULL);
-        av_log(avctx, AV_LOG_DEBUG, "mid fifo [%p] Get frame ,size:%d\n", avframe_tmp,
-               av_fifo_size(ctx->mid_avframe_fifo));
-
-        av_frame_ref(avframe, avframe_tmp);
-        av_frame_free(&avframe_tmp);
+    while (is_internel != 1 && (avframe_tmp = ff_topscodec_ring_read_slot(&ctx->mid_frame_ring))) {
+        av_frame_move_ref(avframe, avframe_tmp);
+        ff_topscodec_ring_read_commit(&ctx->mid_frame_ring);
+        if (ctx->coalesce) {
+            avframe->pts = ff_topscodec_pts_queue_pop(&ctx->coalesce_pts, avframe->pts);
+            if (topscodec_out_fps_drop(avctx, avframe->pts)) {
+                av_frame_unref(avframe);
+                continue;
+            }
+        }
+        av_log(avctx, AV_LOG_DEBUG, "mid ring [%p] Get frame ,size:%u\n", avframe_tmp,
+               ff_topscodec_ring_count(&ctx->mid_frame_ring));
         return 0;
     }
 
     if (ctx->callback) {
-        if (ctx->recv_outport_eos) return AVERROR_EOF;
+        if (atomic_load(&ctx->recv_outport_eos)) return AVERROR_EOF;
         return AVERROR(EAGAIN);
     }
 
-    // idx = ctx->idx_put;
-    ret = ctx->topscodec_lib_ctx->lib_topscodecDecFrameMap(ctx->handle, &ctx->ef_buf_frame[idx]->ef_frame);
+map:
+    efbuf = topscodec_efbuf_get(avctx, ctx->handle);
+    if (!efbuf) return AVERROR(ENOMEM);
+
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecFrameMap(ctx->handle, &efbuf->ef_frame);
     if (TOPSCODEC_SUCCESS == ret) {
-        if (ctx->draining &&
-            (0 == ctx->ef_buf_frame[idx]->ef_frame.width || 0 == ctx->ef_buf_frame[idx]->ef_frame.height)) {
+        if (ctx->draining && (0 == efbuf->ef_frame.width || 0 == efbuf->ef_frame.height)) {
             av_log(avctx, AV_LOG_DEBUG, "----EOS -----\n");
-            ctx->recv_outport_eos = 1;
+            atomic_store(&ctx->recv_outport_eos, 1);
+            ff_topscodec_efbuf_release(efbuf);
             av_usleep(10);
             return AVERROR_EOF;
         }
-        print_frame(avctx, &ctx->ef_buf_frame[idx]->ef_frame);
-        ctx->total_frame_count++;
-        av_log(avctx, AV_LOG_DEBUG, "total_frame_count:%lld\n", ctx->total_frame_count);
+        print_frame(avctx, &efbuf->ef_frame);
+        atomic_fetch_add(&ctx->total_frame_count, 1);
+        /* coalesced packets share a pts and decode order is not sorted by pts, those pair up in output order */
+        pts       = ctx->coalesce || topscodec_decode_order(avctx) ? AV_NOPTS_VALUE : (int64_t)efbuf->ef_frame.pts;
+        companion = topscodec_companion_get(avctx, pts);
+        /* ring frames of a coalesced stream are decided when they are read back */
+        if (ctx->coalesce && is_internel != 1)
+            pts = ff_topscodec_pts_queue_pop(&ctx->coalesce_pts, (int64_t)efbuf->ef_frame.pts);
+        else
+            pts = ctx->coalesce ? AV_NOPTS_VALUE : (int64_t)efbuf->ef_frame.pts;
+        if (topscodec_out_fps_drop(avctx, pts)) {
+            /* unmapped right away, no avframe and no transfer */
+            ff_topscodec_efbuf_unref(efbuf);
+            if (companion) ff_topscodec_efbuf_unref(companion);
+            companion = NULL;
+            goto map;
+        }
+        av_log(avctx, AV_LOG_DEBUG, "total_frame_count:%llu\n",
+               (unsigned long long)atomic_load(&ctx->total_frame_count));
         av_log(avctx, AV_LOG_DEBUG, "topscodecDecFrameMap success\n");
     } else if (TOPSCODEC_ERROR_BUFFER_EMPTY == ret) {
         av_log(avctx, AV_LOG_DEBUG, "TOPSCODEC_ERROR_BUFFER_EMPTY1\n");
+        ff_topscodec_efbuf_release(efbuf);
         return AVERROR(EAGAIN);
     } else {
         av_log(avctx, AV_LOG_ERROR, "topscodecDecFrameMap failed, ret(%d)\n", ret);
+        ff_topscodec_efbuf_release(efbuf);
         return AVERROR(EPERM);
     }
 
-    if (!ctx->recv_first_frame) ctx->recv_first_frame = 1;
+    atomic_store(&ctx->recv_first_frame, 1);
 
     ret = ff_decode_frame_props(avctx, avframe);
     if (ret < 0) {
         av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props failed\n");
+        ff_topscodec_efbuf_unref(efbuf);
+        if (companion) ff_topscodec_efbuf_unref(companion);
         return AVERROR_BUG;
     }
 
     if (avctx->pix_fmt == AV_PIX_FMT_TOPSCODEC) {
-        ctx->ef_buf_frame[idx]->avctx      = avctx;
-        ctx->ef_buf_frame[idx]->ef_context = ctx;
-        ret                                = ff_topscodec_efbuf_to_avframe(ctx->ef_buf_frame[idx], avframe);
-        if (ret < 0) return AVERROR_BUG;
+        ret = ff_topscodec_efbuf_to_avframe(efbuf, avframe);
+        ff_topscodec_efbuf_unref(efbuf);
+        if (ret < 0) goto fail;
     } else {
-        ctx->ef_buf_frame[idx]->avctx      = avctx;
-        ctx->ef_buf_frame[idx]->ef_context = ctx;
-        ret                                = ff_topscodec_efbuf_to_avframe(ctx->ef_buf_frame[idx], &ctx->mid_frame);
-        if (ret < 0) return AVERROR_BUG;
+        ret = ff_topscodec_efbuf_to_avframe(efbuf, &ctx->mid_frame);
+        ff_topscodec_efbuf_unref(efbuf);
+        if (ret < 0) goto fail;
         // 这里位置不要移动，av_hwframe_transfer_data会用到
         avframe->format = ctx->mid_frame.format;
         avframe->width  = ctx->mid_frame.width;
@@ -1129,7 +2304,7 @@ static int topscodec_recived_helper(AVCodecContext* avctx, AVFrame* avframe, int
         if (ret) {
             av_log(avctx, AV_LOG_ERROR, "av_frame_copy failed\n");
             av_frame_unref(&ctx->mid_frame);
-            return AVERROR_BUG;
+            goto fail;
         }
         //  dump_frame_info(&ctx->mid_frame);
         av_frame_copy_props(avframe, &ctx->mid_frame);
@@ -1138,9 +2313,144 @@ static int topscodec_recived_helper(AVCodecContext* avctx, AVFrame* avframe, int
         avframe->nb_samples     = ctx->mid_frame.nb_samples;
         av_frame_unref(&ctx->mid_frame);
     }
-    avframe->coded_picture_number = ctx->total_frame_count;
+    avframe->coded_picture_number = atomic_load(&ctx->total_frame_count);
+    /* frames kept in the ring get their pts when they are read back */
+    if (ctx->coalesce && is_internel != 1) avframe->pts = pts;
+    if (companion) topscodec_companion_attach(avctx, avframe, companion);
     dump_frame_info(avframe);
     return ret;
+
+fail:
+    if (companion) ff_topscodec_efbuf_unref(companion);
+    return AVERROR_BUG;
+}
+
+/*
+ * skip_frame may change between calls. Only the NONKEY threshold maps onto the
+ * codec (IDR sampling), it is moved on the live handle without a reinit.
+ */
+static void topscodec_update_skip_frame(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    topscodecDecParams_t params;
+    enum AVDiscard       prev = ctx->skip_frame;
+    int                  ret;
+
+    if (avctx->skip_frame == prev) return;
+    /* the params would carry unchecked crop/resize/rotation, topscodec_update_pp() sends both */
+    if (topscodec_pp_changed(ctx)) return;
+    ctx->skip_frame = avctx->skip_frame;
+    /* static sampling options win, coalescing needs every frame for its pts queue */
+    if (ctx->enable_sfo || ctx->coalesce || !ctx->handle) return;
+    if ((prev >= AVDISCARD_NONKEY) == (avctx->skip_frame >= AVDISCARD_NONKEY)) return;
+    if (topscodec_fill_params(avctx, &params) < 0) return;
+
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(ctx->handle, &params);
+    if (TOPSCODEC_SUCCESS != ret)
+        av_log(avctx, AV_LOG_WARNING, "topscodecDecSetParams for skip_frame:%d failed, ret(%d), dropping in software\n",
+               avctx->skip_frame, ret);
+    else
+        av_log(avctx, AV_LOG_DEBUG, "skip_frame:%d -> %d applied on handle:%p\n", prev, avctx->skip_frame,
+               ctx->handle);
+    topscodec_companion_update(avctx);
+}
+
+/*
+ * crop/resize/rotation set with av_opt_set() while decoding. The change is
+ * checked and set on the live handle before the next packet goes in, if the
+ * handle refuses it the change waits for a key frame. The frames context
+ * follows the size of each output frame, so it needs no rebuild.
+ */
+static void topscodec_update_pp(AVCodecContext* avctx, int key) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    topscodecDecParams_t params;
+    int                  width  = ctx->in_width;
+    int                  height = ctx->in_height;
+    int                  ret;
+
+    if (!ctx->handle || !topscodec_pp_changed(ctx)) {
+        ctx->pp_pending = 0;
+        return;
+    }
+    if (ctx->pp_pending && !key) return;
+
+    if (topscodec_check_pp(avctx, &width, &height) < 0 || topscodec_fill_params(avctx, &params) < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid post processing change, keep the current one.\n");
+        topscodec_pp_revert(ctx);
+        return;
+    }
+    ret = ctx->topscodec_lib_ctx->lib_topscodecDecSetParams(ctx->handle, &params);
+    if (TOPSCODEC_SUCCESS != ret) {
+        av_log(avctx, AV_LOG_DEBUG, "topscodecDecSetParams refused, ret(%d), retry at the next key frame\n", ret);
+        ctx->pp_pending = 1;
+        return;
+    }
+    print_param(avctx, &params);
+    av_log(avctx, AV_LOG_DEBUG, "post processing changed, out dim:%dx%d -> %dx%d\n", ctx->out_width,
+           ctx->out_height, width, height);
+    ctx->out_width  = width;
+    ctx->out_height = height;
+    ctx->skip_frame = avctx->skip_frame;
+    topscodec_pp_snapshot(ctx);
+    topscodec_companion_update(avctx);
+}
+
+/* what the codec could not sample is dropped here, by the type of the decoded picture */
+static int topscodec_skip_frame(AVCodecContext* avctx, const AVFrame* frame) {
+    if (avctx->skip_frame >= AVDISCARD_ALL) return 1;
+    if (avctx->skip_frame >= AVDISCARD_NONKEY) return !frame->key_frame;
+    if (avctx->skip_frame >= AVDISCARD_NONINTRA) return frame->pict_type != AV_PICTURE_TYPE_I;
+    /* there is no reference flag on the output, B frames are the usual non-reference ones */
+    if (avctx->skip_frame >= AVDISCARD_NONREF) return frame->pict_type == AV_PICTURE_TYPE_B;
+    return 0;
+}
+
+/*
+ * The producer, the codec callback thread in callback mode, only replaces ctx->hwframe on a
+ * new geometry. What the caller sees follows here, on its own thread, with the frames it gets.
+ */
+static void topscodec_output_geometry(AVCodecContext* avctx, const AVFrame* frame) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    AVBufferRef*         ref;
+    int                  rotated;
+
+    if (frame->hw_frames_ctx && (!avctx->hw_frames_ctx || frame->hw_frames_ctx->data != avctx->hw_frames_ctx->data)) {
+        ref = av_buffer_ref(frame->hw_frames_ctx);
+        if (ref) {
+            av_buffer_unref(&avctx->hw_frames_ctx);
+            avctx->hw_frames_ctx = ref;
+        }
+    }
+    if (frame->width == avctx->width && frame->height == avctx->height) return;
+    av_log(avctx, AV_LOG_VERBOSE, "output geometry %dx%d -> %dx%d\n", avctx->width, avctx->height, frame->width,
+           frame->height);
+    avctx->width    = frame->width;
+    avctx->height   = frame->height;
+    ctx->out_width  = frame->width;
+    ctx->out_height = frame->height;
+
+    /* crop and resize fix the output size, without them the frame shows the new input size */
+    if (ctx->enable_crop || ctx->enable_resize) return;
+    rotated        = ctx->enable_rotation && (ctx->rotation == 90 || ctx->rotation == 270);
+    ctx->in_width  = rotated ? frame->height : frame->width;
+    ctx->in_height = rotated ? frame->width : frame->height;
+    if (ctx->companion_handle && (ctx->companion.width > ctx->in_width || ctx->companion.height > ctx->in_height)) {
+        av_log(avctx, AV_LOG_WARNING, "companion %dx%d is larger than the new input %dx%d, disabled.\n",
+               ctx->companion.width, ctx->companion.height, ctx->in_width, ctx->in_height);
+        topscodec_companion_destroy(avctx);
+    }
+}
+
+static int topscodec_recived_output(AVCodecContext* avctx, AVFrame* avframe) {
+    int ret;
+
+    while ((ret = topscodec_recived_helper(avctx, avframe, 0, 0)) >= 0) {
+        topscodec_output_geometry(avctx, avframe);
+        if (!topscodec_skip_frame(avctx, avframe)) break;
+        av_log(avctx, AV_LOG_DEBUG, "skip_frame:%d, drop pict_type:%c\n", avctx->skip_frame,
+               av_get_picture_type_char(avframe->pict_type));
+        av_frame_unref(avframe);
+    }
+    return ret;
 }
 
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)  // n3.2
@@ -1153,7 +2463,11 @@ static int topscodec_decode(AVCodecContext* avctx, void* data, int* got_frame, A
     AVPacket filtered_packet = {0};
     int      ret             = 0;
     int      ret2            = 0;
+    int      wait            = 0;
     int      sleep_handle    = 0;
+    i32_t    stream_timeout  = 0;
+    unsigned seq             = 0;
+    int64_t  deadline        = 0;
 
     if (NULL == avctx || NULL == avctx->priv_data) {
         av_log(avctx, AV_LOG_ERROR, "Early error in topscodec_receive_frame\n");
@@ -1165,11 +2479,12 @@ static int topscodec_decode(AVCodecContext* avctx, void* data, int* got_frame, A
         av_log(avctx, AV_LOG_ERROR, "Decode got abort or not init, return AVERROR_EXTERNAL \n");
         return AVERROR_BUG;
     }
+    topscodec_update_skip_frame(avctx);
 
     // if (ctx->recv_outport_eos && ctx->idx_put == ctx->idx_get) {
     //     return AVERROR_EOF;
     // }
-    if (ctx->recv_outport_eos && av_fifo_size(ctx->mid_avframe_fifo) == 0) {
+    if (atomic_load(&ctx->recv_outport_eos) && ff_topscodec_ring_count(&ctx->mid_frame_ring) == 0) {
         return AVERROR_EOF;
     }
 
@@ -1196,6 +2511,7 @@ static int topscodec_decode(AVCodecContext* avctx, void* data, int* got_frame, A
         avpkt = &filtered_packet;
     }
 
+    topscodec_update_pp(avctx, avpkt->flags & AV_PKT_FLAG_KEY);
     ctx->ef_buf_pkt->avctx      = avctx;
     ctx->ef_buf_pkt->ef_context = ctx;
     if (avpkt->size == 0) {
@@ -1210,77 +2526,82 @@ static int topscodec_decode(AVCodecContext* avctx, void* data, int* got_frame, A
             p.data = avctx->extradata;
             p.size = avctx->extradata_size;
             p.pts  = 0;
+            if (topscodec_stream_buf_reserve(avctx, p.size) < 0) goto fail;
             ff_topscodec_avpkt_to_efbuf(&p, ctx->ef_buf_pkt);
             print_stream(avctx, &ctx->ef_buf_pkt->ef_pkt);
             do {
+                seq = topscodec_event_seq(ctx);
                 ret = ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(ctx->handle, &ctx->ef_buf_pkt->ef_pkt,
-                                                                        0); /*timeout is 0*/
+                                                                        topscodec_stream_timeout(ctx));
                 if (ret != TOPSCODEC_SUCCESS) {
                     if (ret == TOPSCODEC_ERROR_TIMEOUT) {
                         av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream timeout,retry again!\n");
-                        sleep_wait(&sleep_handle);
+                        topscodec_wait(ctx, seq, &sleep_handle);
                     } else {
                         av_log(avctx, AV_LOG_ERROR, "topscodecDecSendStream failed. ret = %d\n", ret);
                         goto fail;
                     }
                 }
             } while (ret == TOPSCODEC_ERROR_TIMEOUT);
+            if (topscodec_companion_send(avctx) < 0) goto fail;
+            topscodec_stream_slot_next(ctx);
         }
-        ctx->first_packet = 0;
+        ctx->first_packet         = 0;
+        ctx->first_frame_deadline = av_gettime_relative() + ctx->recv_timeout * 1000LL;
     }
+    if (topscodec_stream_buf_reserve(avctx, avpkt->size) < 0) goto fail;
     ff_topscodec_avpkt_to_efbuf(avpkt, ctx->ef_buf_pkt);
     print_stream(avctx, &ctx->ef_buf_pkt->ef_pkt);
     do {
+        seq = topscodec_event_seq(ctx);
         ret = ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(ctx->handle, &ctx->ef_buf_pkt->ef_pkt,
-                                                                0); /*timeout is 0*/
+                                                                stream_timeout); /*0 means poll*/
         if (ret != TOPSCODEC_SUCCESS) {
             if (ret == TOPSCODEC_ERROR_TIMEOUT) {
                 if (ctx->callback) {
-                    sleep_wait(&sleep_handle);
+                    topscodec_wait(ctx, seq, &sleep_handle);
                     continue;
                 }
-                // last_received_frame array is not full
-                // AVFrame* tmp = ctx->last_received_frame[ctx->idx_put];
-                AVFrame* tmp = av_frame_alloc();
-                // if (ctx->idx_get - ctx->idx_put != 1 && ctx->idx_get - ctx->idx_put != -(MAX_FRAME_NUM - 2)) {
-                ret2 = topscodec_recived_helper(avctx, tmp, 1, 0);
+                // the ring is full, leave the frames mapped until the caller drains it
+                AVFrame* tmp = ff_topscodec_ring_write_slot(&ctx->mid_frame_ring);
+                ret2         = tmp ? topscodec_recived_helper(avctx, tmp, 1, 0) : AVERROR(EAGAIN);
                 if (0 == ret2) {
-                    // ctx->idx_put = (ctx->idx_put + 1) % MAX_FRAME_NUM;
-                    // av_log(avctx, AV_LOG_DEBUG, "add frame to queue,put:%d,get:%d!\n", ctx->idx_put, ctx->idx_get);
-                    if (av_fifo_space(ctx->mid_avframe_fifo) < sizeof(AVFrame*)) {
-                        av_fifo_grow(ctx->mid_avframe_fifo, 5 * sizeof(AVFrame*));
-                        av_log(avctx, AV_LOG_DEBUG, "mid_frame fifo grow success, size:%d.\n",
-                               av_fifo_size(ctx->mid_avframe_fifo));
-                    }
-                    av_fifo_generic_write(ctx->mid_avframe_fifo, &tmp, sizeof(AVFrame*), NULL);
-                    av_log(avctx, AV_LOG_DEBUG, "mid_frame fifo [%p] write success, size:%d.\n", tmp,
-                           av_fifo_size(ctx->mid_avframe_fifo));
+                    ff_topscodec_ring_write_commit(&ctx->mid_frame_ring);
+                    av_log(avctx, AV_LOG_DEBUG, "mid_frame ring [%p] write success, size:%u.\n", tmp,
+                           ff_topscodec_ring_count(&ctx->mid_frame_ring));
                 } else if (AVERROR(EAGAIN) == ret2) {
                     // do nothing
-                    av_usleep(2);
-                    av_frame_free(&tmp);
+                    if (ctx->wait_mode != TOPSCODEC_WAIT_EVENT) av_usleep(2);
+                    if (tmp) av_frame_unref(tmp);
                     av_log(avctx, AV_LOG_DEBUG, "TOPSCODEC_ERROR_BUFFER_EMPTY22\n");
                 } else {
                     av_log(avctx, AV_LOG_ERROR, "topscodec_recived_helper failed. ret = %d\n", ret2);
-                    av_frame_free(&tmp);
+                    av_frame_unref(tmp);
                     goto fail;
                 }
                 // }
                 av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream timeout,retry again!\n");
-                sleep_wait(&sleep_handle);
+                if (ctx->wait_mode == TOPSCODEC_WAIT_EVENT) {
+                    /* nothing came out, let the driver block until the input slot frees up */
+                    stream_timeout = (0 == ret2) ? 0 : topscodec_stream_timeout(ctx);
+                } else {
+                    sleep_wait(&sleep_handle);
+                }
             } else {
                 av_log(avctx, AV_LOG_ERROR, "topscodecDecSendStream failed. ret = %d\n", ret);
                 goto fail;
             }
         } else {
             av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream success\n");
+            if (topscodec_companion_send(avctx) < 0) goto fail;
+            topscodec_stream_slot_next(ctx);
 
             if (av_fifo_size(ctx->pkt_prop_fifo) > 0) break;
-            prop_frame = av_frame_alloc();
-            ret        = ff_decode_frame_props(avctx, prop_frame);
+            prop_frame = ff_topscodec_frame_pool_get(&ctx->frame_pool);
+            ret        = prop_frame ? ff_decode_frame_props(avctx, prop_frame) : AVERROR(ENOMEM);
             if (ret < 0) {
                 av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props failed receive frame\n");
-                av_frame_free(prop_frame);
+                ff_topscodec_frame_pool_put(&ctx->frame_pool, prop_frame);
                 goto fail;
             }
             if (av_fifo_space(ctx->pkt_prop_fifo) < sizeof(AVFrame*)) {
@@ -1295,9 +2616,12 @@ static int topscodec_decode(AVCodecContext* avctx, void* data, int* got_frame, A
 
     av_packet_unref(avpkt);
 recv:
-    ret = topscodec_recived_helper(avctx, frame, 0, 0);
+    seq = topscodec_event_seq(ctx);
+    ret = topscodec_recived_output(avctx, frame);
     if (ret == AVERROR(EAGAIN)) {
-        if (ctx->draining) {
+        wait = topscodec_recv_wait(avctx, seq, &sleep_handle, &deadline);
+        if (wait < 0) return wait;
+        if (wait) {
             av_log(avctx, AV_LOG_DEBUG, "repeating ,ret:%d\n", ret);
             goto recv;
         } else {
@@ -1319,11 +2643,147 @@ fail:
 #endif  // n3.2
 
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 100, 100)  // n4.0
-static int topscodec_receive_frame(AVCodecContext* avctx, AVFrame* frame) {
-    EFCodecDecContext_t* ctx;
+/* hand ctx->ef_buf_pkt to the codec, retrying while its input slots are full */
+static int topscodec_send_stream(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
     AVFrame*             prop_frame;
     int                  ret, ret2;
+    int                  sleep_handle   = 0;
+    i32_t                stream_timeout = 0;
+    unsigned             seq            = 0;
+
+    print_stream(avctx, &ctx->ef_buf_pkt->ef_pkt);
+    do {
+        seq = topscodec_event_seq(ctx);
+        ret = ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(ctx->handle, &ctx->ef_buf_pkt->ef_pkt,
+                                                                stream_timeout); /*0 means poll*/
+        if (ret != TOPSCODEC_SUCCESS) {
+            if (ret == TOPSCODEC_ERROR_TIMEOUT) {
+                if (ctx->callback) {
+                    topscodec_wait(ctx, seq, &sleep_handle);
+                    continue;
+                }
+                // the ring is full, leave the frames mapped until the caller drains it
+                AVFrame* tmp = ff_topscodec_ring_write_slot(&ctx->mid_frame_ring);
+                ret2         = tmp ? topscodec_recived_helper(avctx, tmp, 1, 0) : AVERROR(EAGAIN);
+                if (0 == ret2) {
+                    ff_topscodec_ring_write_commit(&ctx->mid_frame_ring);
+                    av_log(avctx, AV_LOG_DEBUG, "mid_frame ring [%p] write success, size:%u.\n", tmp,
+                           ff_topscodec_ring_count(&ctx->mid_frame_ring));
+                } else if (AVERROR(EAGAIN) == ret2) {
+                    // do nothing
+                    if (ctx->wait_mode != TOPSCODEC_WAIT_EVENT) av_usleep(2);
+                    if (tmp) av_frame_unref(tmp);
+                    av_log(avctx, AV_LOG_DEBUG, "TOPSCODEC_ERROR_BUFFER_EMPTY22\n");
+                } else {
+                    av_frame_unref(tmp);
+                    av_log(avctx, AV_LOG_ERROR, "topscodec_recived_helper failed. ret = %d\n", ret2);
+                    goto fail;
+                }
+                // }
+                av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream timeout,retry again!\n");
+                if (ctx->wait_mode == TOPSCODEC_WAIT_EVENT) {
+                    /* nothing came out, let the driver block until the input slot frees up */
+                    stream_timeout = (0 == ret2) ? 0 : topscodec_stream_timeout(ctx);
+                } else {
+                    sleep_wait(&sleep_handle);
+                }
+            } else {
+                av_log(avctx, AV_LOG_ERROR, "topscodecDecSendStream failed. ret = %d\n", ret);
+                goto fail;
+            }
+        } else {
+            av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream success\n");
+            if (topscodec_companion_send(avctx) < 0) goto fail;
+            topscodec_stream_slot_next(ctx);
+
+            if (av_fifo_size(ctx->pkt_prop_fifo) > 0) break;
+            prop_frame = ff_topscodec_frame_pool_get(&ctx->frame_pool);
+            ret        = prop_frame ? ff_decode_frame_props(avctx, prop_frame) : AVERROR(ENOMEM);
+            if (ret < 0) {
+                av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props failed receive frame\n");
+                ff_topscodec_frame_pool_put(&ctx->frame_pool, prop_frame);
+                goto fail;
+            }
+            if (av_fifo_space(ctx->pkt_prop_fifo) < sizeof(AVFrame*)) {
+                av_fifo_grow(ctx->pkt_prop_fifo, 5 * sizeof(AVFrame*));
+                av_log(avctx, AV_LOG_DEBUG, "prop fifo grow success, size:%d.\n", av_fifo_size(ctx->pkt_prop_fifo));
+            }
+            av_fifo_generic_write(ctx->pkt_prop_fifo, &prop_frame, sizeof(AVFrame*), NULL);
+            av_log(avctx, AV_LOG_DEBUG, "prop fifo [%p] write success, size:%d.\n", prop_frame,
+                   av_fifo_size(ctx->pkt_prop_fifo));
+        }
+    } while (ret == TOPSCODEC_ERROR_TIMEOUT);
+    return 0;
+
+fail:
+    return AVERROR_BUG;
+}
+
+static int topscodec_coalesce_due(EFCodecDecContext_t* ctx) {
+    return ctx->coalesce_nb > 0 && (ctx->ef_buf_pkt->ef_pkt.data_len >= ctx->coalesce_bytes ||
+                                    av_gettime_relative() - ctx->coalesce_start >= ctx->coalesce_delay * 1000LL);
+}
+
+static int topscodec_coalesce_submit(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+
+    av_log(avctx, AV_LOG_DEBUG, "coalesce submit %d packets, %u bytes\n", ctx->coalesce_nb,
+           ctx->ef_buf_pkt->ef_pkt.data_len);
+    ctx->coalesce_nb    = 0;
+    ctx->stream_buf_hwm = FFMAX(ctx->stream_buf_hwm, ctx->ef_buf_pkt->ef_pkt.data_len);
+    return topscodec_send_stream(avctx);
+}
+
+/*
+ * Append ctx->av_pkt to the batch pending in the stream buffer. The batch is
+ * sent in one DecodeStream call once it reaches coalesce_bytes, once its first
+ * packet is coalesce_delay ms old, when the next packet does not fit, or at EOS.
+ */
+static int topscodec_coalesce_packet(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx = avctx->priv_data;
+    AVPacket*            pkt = ctx->av_pkt;
+    int                  ret = 0;
+
+    if (ctx->coalesce_nb > 0 &&
+        (pkt->size <= 0 || ctx->ef_buf_pkt->ef_pkt.data_len + pkt->size > ctx->stream_buf_size)) {
+        ret = topscodec_coalesce_submit(avctx);
+        if (ret < 0) return ret;
+    }
+
+    if (pkt->size <= 0) {
+        ff_topscodec_avpkt_to_efbuf(pkt, ctx->ef_buf_pkt);
+        return topscodec_send_stream(avctx);
+    }
+
+    if (ctx->coalesce_nb == 0) {
+        /* a batch never moves, the buffer only grows between batches */
+        ret = topscodec_stream_buf_reserve(avctx, pkt->size);
+        if (ret < 0) return ret;
+        ret                 = ff_topscodec_avpkt_to_efbuf(pkt, ctx->ef_buf_pkt);
+        ctx->coalesce_start = av_gettime_relative();
+    } else {
+        ret = ff_topscodec_avpkt_append_efbuf(pkt, ctx->ef_buf_pkt);
+    }
+    if (ret < 0) return ret;
+
+    /* the batch is known by the pts the codec got for its first packet */
+    ret = ff_topscodec_pts_queue_push(&ctx->coalesce_pts, pkt->pts, (int64_t)ctx->ef_buf_pkt->ef_pkt.pts);
+    if (ret < 0) return ret;
+    ctx->coalesce_nb++;
+    atomic_fetch_add(&ctx->total_packet_count, 1);
+
+    if (topscodec_coalesce_due(ctx)) return topscodec_coalesce_submit(avctx);
+    return 0;
+}
+
+static int topscodec_receive_frame(AVCodecContext* avctx, AVFrame* frame) {
+    EFCodecDecContext_t* ctx;
+    int                  ret;
+    int                  wait;
     int                  sleep_handle = 0;
+    unsigned             seq          = 0;
+    int64_t              deadline     = 0;
 
     if (NULL == avctx || NULL == avctx->priv_data) {
         av_log(avctx, AV_LOG_ERROR, "Early error in topscodec_receive_frame\n");
@@ -1335,11 +2795,12 @@ static int topscodec_receive_frame(AVCodecContext* avctx, AVFrame* frame) {
         av_log(avctx, AV_LOG_ERROR, "Decode got abort or not init, return AVERROR_EXTERNAL \n");
         return AVERROR_BUG;
     }
+    topscodec_update_skip_frame(avctx);
 
     // if (ctx->recv_outport_eos && ctx->idx_put == ctx->idx_get) {
     //     return AVERROR_EOF;
     // }
-    if (ctx->recv_outport_eos && av_fifo_size(ctx->mid_avframe_fifo) == 0) {
+    if (atomic_load(&ctx->recv_outport_eos) && ff_topscodec_ring_count(&ctx->mid_frame_ring) == 0) {
         return AVERROR_EOF;
     }
 
@@ -1347,7 +2808,9 @@ static int topscodec_receive_frame(AVCodecContext* avctx, AVFrame* frame) {
         ret = ff_decode_get_packet(avctx, ctx->av_pkt);
         if (ret < 0) {
             if (ret == AVERROR(EAGAIN)) {
-                return topscodec_recived_helper(avctx, frame, 0, 0);
+                /* no new input, do not hold a batch past its deadline */
+                if (topscodec_coalesce_due(ctx) && topscodec_coalesce_submit(avctx) < 0) goto fail;
+                return topscodec_recived_output(avctx, frame);
             } else if (ret != AVERROR_EOF) {
                 return ret;
             }
@@ -1355,6 +2818,7 @@ static int topscodec_receive_frame(AVCodecContext* avctx, AVFrame* frame) {
     }
 
     if (ctx->draining) goto dequeue;
+    topscodec_update_pp(avctx, ctx->av_pkt->flags & AV_PKT_FLAG_KEY);
 
     // if (!ctx->av_pkt->size && !ctx->recv_first_frame)
     //     goto dequeue;
@@ -1373,97 +2837,51 @@ static int topscodec_receive_frame(AVCodecContext* avctx, AVFrame* frame) {
             p.data = avctx->extradata;
             p.size = avctx->extradata_size;
             p.pts  = 0;
+            if (topscodec_stream_buf_reserve(avctx, p.size) < 0) goto fail;
             ff_topscodec_avpkt_to_efbuf(&p, ctx->ef_buf_pkt);
             print_stream(avctx, &ctx->ef_buf_pkt->ef_pkt);
             do {
+                seq = topscodec_event_seq(ctx);
                 ret = ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(ctx->handle, &ctx->ef_buf_pkt->ef_pkt,
-                                                                        0); /*timeout is 0*/
+                                                                        topscodec_stream_timeout(ctx));
                 if (ret != TOPSCODEC_SUCCESS) {
                     if (ret == TOPSCODEC_ERROR_TIMEOUT) {
                         av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream timeout,retry again!\n");
-                        sleep_wait(&sleep_handle);
+                        topscodec_wait(ctx, seq, &sleep_handle);
                     } else {
                         av_log(avctx, AV_LOG_ERROR, "topscodecDecSendStream failed. ret = %d\n", ret);
                         goto fail;
                     }
                 }
             } while (ret == TOPSCODEC_ERROR_TIMEOUT);
+            if (topscodec_companion_send(avctx) < 0) goto fail;
+            topscodec_stream_slot_next(ctx);
         }
-        ctx->first_packet = 0;
+        ctx->first_packet         = 0;
+        ctx->first_frame_deadline = av_gettime_relative() + ctx->recv_timeout * 1000LL;
     }
-    ff_topscodec_avpkt_to_efbuf(ctx->av_pkt, ctx->ef_buf_pkt);
-    ctx->total_packet_count++;
-    print_stream(avctx, &ctx->ef_buf_pkt->ef_pkt);
-    do {
-        ret = ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(ctx->handle, &ctx->ef_buf_pkt->ef_pkt,
-                                                                0); /*timeout is 0*/
-        if (ret != TOPSCODEC_SUCCESS) {
-            if (ret == TOPSCODEC_ERROR_TIMEOUT) {
-                if (ctx->callback) {
-                    sleep_wait(&sleep_handle);
-                    continue;
-                }
-                // last_received_frame array is not full
-                // AVFrame* tmp = ctx->last_received_frame[ctx->idx_put];
-                AVFrame* tmp = av_frame_alloc();
-                // if (ctx->idx_get - ctx->idx_put != 1 && ctx->idx_get - ctx->idx_put != -(MAX_FRAME_NUM - 2)) {
-                ret2 = topscodec_recived_helper(avctx, tmp, 1, 0);
-                if (0 == ret2) {
-                    // ctx->idx_put = (ctx->idx_put + 1) % MAX_FRAME_NUM;
-                    // av_log(avctx, AV_LOG_DEBUG, "add frame to queue,put:%d,get:%d!\n", ctx->idx_put, ctx->idx_get);
-                    if (av_fifo_space(ctx->mid_avframe_fifo) < sizeof(AVFrame*)) {
-                        av_fifo_grow(ctx->mid_avframe_fifo, 5 * sizeof(AVFrame*));
-                        av_log(avctx, AV_LOG_DEBUG, "mid_frame fifo grow success, size:%d.\n",
-                               av_fifo_size(ctx->mid_avframe_fifo));
-                    }
-                    av_fifo_generic_write(ctx->mid_avframe_fifo, &tmp, sizeof(AVFrame*), NULL);
-                    av_log(avctx, AV_LOG_DEBUG, "mid_frame fifo [%p] write success, size:%d.\n", tmp,
-                           av_fifo_size(ctx->mid_avframe_fifo));
-                } else if (AVERROR(EAGAIN) == ret2) {
-                    // do nothing
-                    av_usleep(2);
-                    av_frame_free(&tmp);
-                    av_log(avctx, AV_LOG_DEBUG, "TOPSCODEC_ERROR_BUFFER_EMPTY22\n");
-                } else {
-                    av_frame_free(&tmp);
-                    av_log(avctx, AV_LOG_ERROR, "topscodec_recived_helper failed. ret = %d\n", ret2);
-                    goto fail;
-                }
-                // }
-                av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream timeout,retry again!\n");
-                sleep_wait(&sleep_handle);
-            } else {
-                av_log(avctx, AV_LOG_ERROR, "topscodecDecSendStream failed. ret = %d\n", ret);
-                goto fail;
-            }
-        } else {
-            av_log(avctx, AV_LOG_DEBUG, "topscodecDecodeStream success\n");
-
-            if (av_fifo_size(ctx->pkt_prop_fifo) > 0) break;
-            prop_frame = av_frame_alloc();
-            ret        = ff_decode_frame_props(avctx, prop_frame);
-            if (ret < 0) {
-                av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props failed receive frame\n");
-                av_frame_free(&prop_frame);
-                goto fail;
-            }
-            if (av_fifo_space(ctx->pkt_prop_fifo) < sizeof(AVFrame*)) {
-                av_fifo_grow(ctx->pkt_prop_fifo, 5 * sizeof(AVFrame*));
-                av_log(avctx, AV_LOG_DEBUG, "prop fifo grow success, size:%d.\n", av_fifo_size(ctx->pkt_prop_fifo));
-            }
-            av_fifo_generic_write(ctx->pkt_prop_fifo, &prop_frame, sizeof(AVFrame*), NULL);
-            av_log(avctx, AV_LOG_DEBUG, "prop fifo [%p] write success, size:%d.\n", prop_frame,
-                   av_fifo_size(ctx->pkt_prop_fifo));
-        }
-    } while (ret == TOPSCODEC_ERROR_TIMEOUT);
+    if (ctx->coalesce) {
+        /* the packet joins the pending batch, which may or may not be sent yet */
+        ret = topscodec_coalesce_packet(avctx);
+    } else {
+        ret = topscodec_stream_buf_reserve(avctx, ctx->av_pkt->size);
+        if (ret < 0) goto fail;
+        ff_topscodec_avpkt_to_efbuf(ctx->av_pkt, ctx->ef_buf_pkt);
+        atomic_fetch_add(&ctx->total_packet_count, 1);
+        ret = topscodec_send_stream(avctx);
+    }
+    if (ret < 0) goto fail;
 
     av_packet_unref(ctx->av_pkt);
 
 dequeue:
     // return topscodec_recived_helper(avctx, frame, 0, 0);
-    ret = topscodec_recived_helper(avctx, frame, 0, 0);
+    seq = topscodec_event_seq(ctx);
+    ret = topscodec_recived_output(avctx, frame);
     if (ret == AVERROR(EAGAIN)) {
-        if (ctx->draining) {
+        wait = topscodec_recv_wait(avctx, seq, &sleep_handle, &deadline);
+        if (wait < 0) return wait;
+        if (wait) {
             av_log(avctx, AV_LOG_DEBUG, "repeating ,ret:%d\n", ret);
             goto dequeue;
         } else {
@@ -1482,11 +2900,40 @@ fail:
 }
 #endif  // n4.4
 
+/*
+ * Recycle the codec handle only. The stream buffer, hw device/frames contexts,
+ * caps, EFBuffer pool and loaded libraries are kept for the new handle.
+ */
+static int topscodec_reset_internel(AVCodecContext* avctx) {
+    EFCodecDecContext_t* ctx         = avctx->priv_data;
+    AVFrame*             avframe_tmp = NULL;
+    int                  ret;
+
+    /* the ring frames are unmapped with the handle they came from */
+    topscodec_ring_drain(avctx);
+    topscodec_companion_destroy(avctx);
+    topscodec_destroy_handle(avctx);
+    topscodec_stream_buf_free_retired(ctx);
+
+    while (av_fifo_size(ctx->pkt_prop_fifo) > 0) {
+        av_fifo_generic_read(ctx->pkt_prop_fifo, &avframe_tmp, sizeof(AVFrame*), NULL);
+        ff_topscodec_frame_pool_put(&ctx->frame_pool, avframe_tmp);
+    }
+    if (ctx->av_pkt) av_packet_unref(ctx->av_pkt);
+
+    topscodec_reset_state(ctx);
+    ret = topscodec_create_handle(avctx);
+    if (ret < 0) return ret;
+    return topscodec_companion_create(avctx);
+}
+
 static void topscodec_flush(struct AVCodecContext* avctx) {
     EFCodecDecContext_t*   ctx;
     TopsRuntimesFunctions* topsruntime = NULL;
     int                    ret;
     int                    planes;
+    int                    discarded = 0;
+    int64_t                start_time;
     size_t                 planesizes[AV_NUM_DATA_POINTERS] = {0};
     int                    linesizes[AV_NUM_DATA_POINTERS]  = {0};
     ptrdiff_t              linesizes1[AV_NUM_DATA_POINTERS] = {0};
@@ -1498,14 +2945,24 @@ static void topscodec_flush(struct AVCodecContext* avctx) {
     ctx         = (EFCodecDecContext_t*)avctx->priv_data;
     topsruntime = ctx->topsruntime_lib_ctx;
 
-    AVFrame* frame = av_frame_alloc();
-    while (!ctx->recv_outport_eos) {
+    start_time     = av_gettime();
+    AVFrame* frame = ff_topscodec_frame_pool_get(&ctx->frame_pool);
+    if (!frame) goto error;
+    while (!atomic_load(&ctx->recv_outport_eos)) {
         ret = topscodec_recived_helper(avctx, frame, 0, 1);
         if (ret == AVERROR(EAGAIN)) {
+            /* the handle is recycled below, frames still inside the codec go with it unless kept */
+            if (ctx->flush_mode == TOPSCODEC_FLUSH_RESET && ctx->flush_policy == TOPSCODEC_FLUSH_DISCARD) break;
             continue;
         } else if (ret == AVERROR_EOF) {
             break;
         }
+        if (ctx->flush_policy == TOPSCODEC_FLUSH_DISCARD) {
+            /* dropping the last ref unmaps the frame, no D2D copy and no pool frame */
+            av_frame_unref(frame);
+            discarded++;
+            continue;
+        }
         if (av_fifo_space(ctx->avframe_fifo) < sizeof(AVFrame*)) {
             av_fifo_grow(ctx->avframe_fifo, 5 * sizeof(AVFrame*));
             av_log(avctx, AV_LOG_DEBUG, "fifo grow success, size:%d.\n", av_fifo_size(ctx->avframe_fifo));
@@ -1524,7 +2981,8 @@ static void topscodec_flush(struct AVCodecContext* avctx) {
             goto error;
         }
 
-        AVFrame* fifo_avframe = av_frame_alloc();
+        AVFrame* fifo_avframe = ff_topscodec_frame_pool_get(&ctx->frame_pool);
+        if (!fifo_avframe) goto error;
         av_frame_copy_props(fifo_avframe, frame);
         fifo_avframe->format         = frame->format;
         fifo_avframe->width          = frame->width;
@@ -1535,18 +2993,25 @@ static void topscodec_flush(struct AVCodecContext* avctx) {
 
         if (avctx->pix_fmt == AV_PIX_FMT_TOPSCODEC) {
             // D2D
-            av_hwframe_get_buffer(avctx->hw_frames_ctx, fifo_avframe, 0);
+            /* the copy goes to a frames context of the size of the frame, which may be newer than avctx's */
+            av_hwframe_get_buffer(frame->hw_frames_ctx ? frame->hw_frames_ctx : avctx->hw_frames_ctx, fifo_avframe, 0);
             for (int i = 0; i < planes; i++) {
                 fifo_avframe->linesize[i] = frame->linesize[i];
                 ret = topsruntime->lib_topsMemcpyDtoD(fifo_avframe->data[i], frame->data[i], planesizes[i]);
                 if (ret != topsSuccess) {
                     av_log(avctx, AV_LOG_ERROR, "flush d2x: dev %p -> dev 0x%p, size %lu\n", frame->data[i],
                            fifo_avframe->data[i], planesizes[i]);
+                    ff_topscodec_frame_pool_put(&ctx->frame_pool, fifo_avframe);
                     goto error;
                 }
                 av_log(avctx, AV_LOG_DEBUG, "flush d2x: dev %p -> dev 0x%p, size %lu\n", frame->data[i],
                        fifo_avframe->data[i], planesizes[i]);
             }
+            /* the companion the copied props point to is held by extended_buf, it goes with them */
+            fifo_avframe->extended_buf    = frame->extended_buf;
+            fifo_avframe->nb_extended_buf = frame->nb_extended_buf;
+            frame->extended_buf           = NULL;
+            frame->nb_extended_buf        = 0;
 
         } else {
             av_frame_ref(fifo_avframe, frame);
@@ -1556,23 +3021,35 @@ static void topscodec_flush(struct AVCodecContext* avctx) {
                av_fifo_size(ctx->avframe_fifo));
         av_frame_unref(frame);
     }
-    if (frame) av_frame_free(&frame);
+    ff_topscodec_frame_pool_put(&ctx->frame_pool, frame);
+    frame = NULL;
 
-    ret = topscodec_decode_close_internel(avctx);
-    if (ret != 0) goto error;
-    ret = topscodec_decode_init_internel(avctx);
-    if (ret != 0) goto error;
-    av_log(avctx, AV_LOG_DEBUG, "topscodec flush success.\n");
+    if (ctx->flush_mode == TOPSCODEC_FLUSH_RESET) {
+        ret = topscodec_reset_internel(avctx);
+        if (ret != 0) goto error;
+    } else {
+        ret = topscodec_decode_close_internel(avctx);
+        if (ret != 0) goto error;
+        ret = topscodec_decode_init_internel(avctx);
+        if (ret != 0) goto error;
+    }
+    av_log(avctx, AV_LOG_DEBUG, "topscodec flush success, mode:%s, discarded:%d, cost:%ldus.\n",
+           ctx->flush_mode == TOPSCODEC_FLUSH_RESET ? "reset" : "full", discarded,
+           (long)(av_gettime() - start_time));
     return;
 error:
-    if (frame) av_frame_free(&frame);
+    ff_topscodec_frame_pool_put(&ctx->frame_pool, frame);
     av_log(avctx, AV_LOG_ERROR, "GCU codec reinit on flush failed\n");
 }
 
 #define OFFSET(x) offsetof(EFCodecDecContext_t, x)
 #define VD AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_DECODING_PARAM
+#ifdef AV_OPT_FLAG_RUNTIME_PARAM
+#define VDR VD | AV_OPT_FLAG_RUNTIME_PARAM
+#else
+#define VDR VD
+#endif
 #define DEFAULT 0
-#define MAX_DEVICE_ID (32)
 
 static const AVOption options[] = {
     {"card_id",
@@ -1605,6 +3082,151 @@ static const AVOption options[] = {
     {"sf", "use to choose the switch ratio", OFFSET(sf), AV_OPT_TYPE_INT, {.i64 = 1}, 0, 500, VD},
     {"out_port_num", "decode outport buf num", OFFSET(output_buf_num), AV_OPT_TYPE_INT, {.i64 = 8}, 0, 100, VD},
     {"in_port_num", "decode inport buf num", OFFSET(input_buf_num), AV_OPT_TYPE_INT, {.i64 = 8}, 0, 100, VD},
+    {"wait_mode",
+     "0-poll(sleep back off), 1-event(block on callback event or driver timeout)",
+     OFFSET(wait_mode),
+     AV_OPT_TYPE_INT,
+     {.i64 = TOPSCODEC_WAIT_POLL},
+     TOPSCODEC_WAIT_POLL,
+     TOPSCODEC_WAIT_EVENT,
+     VD},
+    {"wait_timeout",
+     "upper bound(ms) of one blocking wait",
+     OFFSET(wait_timeout),
+     AV_OPT_TYPE_INT,
+     {.i64 = 100},
+     1,
+     10000,
+     VD},
+    {"flush_mode",
+     "flush rebuilds 0:the whole decoder, 1:only the codec handle",
+     OFFSET(flush_mode),
+     AV_OPT_TYPE_INT,
+     {.i64 = TOPSCODEC_FLUSH_FULL},
+     TOPSCODEC_FLUSH_FULL,
+     TOPSCODEC_FLUSH_RESET,
+     VD},
+    {"coalesce_bytes",
+     "send small packets in batches of this many bytes, 0 disables",
+     OFFSET(coalesce_bytes),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     VD},
+    {"coalesce_delay",
+     "longest time(ms) a packet waits in a batch",
+     OFFSET(coalesce_delay),
+     AV_OPT_TYPE_INT,
+     {.i64 = 5},
+     0,
+     1000,
+     VD},
+    {"flush_policy",
+     "frames drained by flush are 0:kept and returned, 1:discarded",
+     OFFSET(flush_policy),
+     AV_OPT_TYPE_INT,
+     {.i64 = TOPSCODEC_FLUSH_KEEP},
+     TOPSCODEC_FLUSH_KEEP,
+     TOPSCODEC_FLUSH_DISCARD,
+     VD},
+    {"out_fps",
+     "keep the first frame of every 1/out_fps of pts, 0 keeps all",
+     OFFSET(out_fps),
+     AV_OPT_TYPE_RATIONAL,
+     {.dbl = 0},
+     0,
+     INT_MAX,
+     VD},
+    {"companion_w",
+     "width of the downscaled companion frame in the companion side data, 0 disables",
+     OFFSET(companion.width),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     VD},
+    {"companion_h",
+     "height of the downscaled companion frame in the companion side data, 0 disables",
+     OFFSET(companion.height),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     VD},
+    {"companion_m",
+     "companion downscale, 0-Bilinear, 1-Nearest",
+     OFFSET(companion.mode),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     1,
+     VD},
+    {"output_order",
+     "frames come out in 0:display order, 1:decode order(low delay, also set by -flags low_delay)",
+     OFFSET(output_order),
+     AV_OPT_TYPE_INT,
+     {.i64 = TOPSCODEC_DEC_OUTPUT_ORDER_DISPLAY},
+     TOPSCODEC_DEC_OUTPUT_ORDER_DISPLAY,
+     TOPSCODEC_DEC_OUTPUT_ORDER_DECODE,
+     VD},
+    {"recv_timeout",
+     "longest time(ms) to wait for the first frame from the first packet and for each frame of the drain, 0: first "
+     "frame no wait, drain unbounded",
+     OFFSET(recv_timeout),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     60000,
+     VD},
+    {"session_pool",
+     "idle sync sessions the process keeps for reuse, 0 disables",
+     OFFSET(session_pool),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     TOPSCODEC_SESSION_POOL_MAX,
+     VD},
+    {"session_pool_idle",
+     "time(ms) an idle session is kept in the pool",
+     OFFSET(session_pool_idle),
+     AV_OPT_TYPE_INT,
+     {.i64 = 10000},
+     0,
+     INT_MAX,
+     VD},
+    {"mem_budget",
+     "bytes of device memory the decoders sharing a card may use, set by the first one, 0: no budget",
+     OFFSET(mem_budget),
+     AV_OPT_TYPE_INT64,
+     {.i64 = 0},
+     0,
+     INT64_MAX,
+     VD},
+    {"mem_wait",
+     "time(ms) an allocation past mem_budget waits for memory, 0: fail at once, -1: wait forever",
+     OFFSET(mem_wait),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     -1,
+     INT_MAX,
+     VD},
+    {"stream_buf_mode",
+     "stream buffer 0:fixed to width*height*1.25, 1:sized from the bitrate and grown on demand",
+     OFFSET(stream_buf_mode),
+     AV_OPT_TYPE_INT,
+     {.i64 = TOPSCODEC_STREAM_BUF_FIXED},
+     TOPSCODEC_STREAM_BUF_FIXED,
+     TOPSCODEC_STREAM_BUF_ADAPTIVE,
+     VD},
+    {"stream_buf_hwm",
+     "largest upload into the stream buffer so far(bytes), read only",
+     OFFSET(stream_buf_hwm),
+     AV_OPT_TYPE_INT64,
+     {.i64 = 0},
+     0,
+     INT64_MAX,
+     VD | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY},
     {"zero_copy",
      "copy the decoded image to the hw frame buffer(D2D)",
      OFFSET(zero_copy),
@@ -1636,7 +3258,7 @@ static const AVOption options[] = {
      {.i64 = 0},
      -1,
      1,
-     VD},
+     VDR},
     {"rotation",
      "setting rotation, only support orientation,90/180/270",
      OFFSET(rotation),
@@ -1644,8 +3266,8 @@ static const AVOption options[] = {
      {.i64 = 0},
      0,
      INT_MAX,
-     VD},
-    {"enable_crop", "Forces open the crop", OFFSET(enable_crop), AV_OPT_TYPE_BOOL, {.i64 = 0}, -1, 1, VD},
+     VDR},
+    {"enable_crop", "Forces open the crop", OFFSET(enable_crop), AV_OPT_TYPE_BOOL, {.i64 = 0}, -1, 1, VDR},
     {"enable_resize",
      "Forces open the resize,only support downscale",
      OFFSET(enable_resize),
@@ -1653,15 +3275,15 @@ static const AVOption options[] = {
      {.i64 = 0},
      -1,
      1,
-     VD},
+     VDR},
     {"enable_sfo", "enable frame sampling interval", OFFSET(enable_sfo), AV_OPT_TYPE_BOOL, {.i64 = 0}, -1, 1, VD},
-    {"crop_top", "out top (crop)", OFFSET(crop.top), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
-    {"crop_bottom", "out bottom(crop)", OFFSET(crop.bottom), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
-    {"crop_left", "out left(crop)", OFFSET(crop.left), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
-    {"crop_right", "out right(crop)", OFFSET(crop.right), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
-    {"resize_w", "out width(resize)", OFFSET(resize.width), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
-    {"resize_h", "out height(resize)", OFFSET(resize.height), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
-    {"resize_m", "0-Bilinear, 1-Nearest", OFFSET(resize.mode), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
+    {"crop_top", "out top (crop)", OFFSET(crop.top), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
+    {"crop_bottom", "out bottom(crop)", OFFSET(crop.bottom), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
+    {"crop_left", "out left(crop)", OFFSET(crop.left), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
+    {"crop_right", "out right(crop)", OFFSET(crop.right), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
+    {"resize_w", "out width(resize)", OFFSET(resize.width), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
+    {"resize_h", "out height(resize)", OFFSET(resize.height), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
+    {"resize_m", "0-Bilinear, 1-Nearest", OFFSET(resize.mode), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VDR},
     {"sfo", "frame sampling interval value", OFFSET(sfo), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, VD},
     {"idr", "frame sampling interval value", OFFSET(sf_idr), AV_OPT_TYPE_INT, {.i64 = 0}, 0, 1, VD},
     {NULL},
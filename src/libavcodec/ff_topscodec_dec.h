@@ -18,6 +18,8 @@
  * License along with FFmpeg; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  *******************************************************************************/
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -32,6 +34,35 @@
 #define AVCODEC_EF_TOPSCODEC_DEC_H
 #define MAX_FRAME_NUM 10
 
+/*!< How the decoder waits for the hardware when there is no input slot or output frame */
+enum {
+    TOPSCODEC_WAIT_POLL  = 0, /*!< spin on the driver with sleep_wait() back off */
+    TOPSCODEC_WAIT_EVENT = 1, /*!< block on the callback event or the driver timeout */
+};
+
+/*!< What topscodec_flush() rebuilds */
+enum {
+    TOPSCODEC_FLUSH_FULL  = 0, /*!< close and re-init the whole decoder */
+    TOPSCODEC_FLUSH_RESET = 1, /*!< only recycle the codec handle */
+};
+
+/*!< What topscodec_flush() does with the frames it drains */
+enum {
+    TOPSCODEC_FLUSH_KEEP    = 0, /*!< copy them to the flush fifo, returned before new frames */
+    TOPSCODEC_FLUSH_DISCARD = 1, /*!< unmap them, e.g. when the flush comes from a seek */
+};
+
+/*!< How the stream buffer slots are sized */
+enum {
+    TOPSCODEC_STREAM_BUF_FIXED    = 0, /*!< width * height * 1.25, caps max when the dims are unknown */
+    TOPSCODEC_STREAM_BUF_ADAPTIVE = 1, /*!< start from the bitrate, grow when a packet does not fit */
+};
+#define TOPSCODEC_STREAM_BUF_MIN     (256 * 1024)
+#define TOPSCODEC_STREAM_RETIRED_MAX 16
+#define TOPSCODEC_SESSION_POOL_MAX   64
+/* enable_crop/resize/rotation, crop, resize and rotation, see topscodec_pp_fields() */
+#define TOPSCODEC_PP_FIELDS          11
+
 typedef struct {
     AVClass* avclass;
     int      device_id;
@@ -42,6 +73,27 @@ typedef struct {
     int      zero_copy;
     int      output_buf_num;
     int      input_buf_num;
+    int      wait_mode;
+    int      wait_timeout; /*!< ms, upper bound of one blocking wait*/
+    int      flush_mode;
+    int      flush_policy;
+    int      coalesce_bytes; /*!< send packets in batches of this many bytes, 0 disables*/
+    int      coalesce_delay; /*!< ms, longest time a packet waits in a batch*/
+    int      recv_timeout;   /*!< ms, wait for the first frame after the first packet and for each frame of the drain*/
+    int      output_order;   /*!< topscodecDecOutputOrder_t*/
+    AVRational out_fps;      /*!< keep at most this many frames per second of pts, 0 keeps all*/
+    struct {
+        int width;
+        int height;
+        /*!< Downscale mode: 0-Bilinear, 1-Nearest*/
+        int mode;
+    } companion; /*!< downscaled copy of every frame in AV_FRAME_DATA_TOPSCODEC_COMPANION, 0x0 disables*/
+    int      stream_buf_mode;
+    int64_t  stream_buf_hwm; /*!< largest upload into one slot so far, exported*/
+    int      session_pool;      /*!< idle sessions the process keeps for reuse, 0 disables*/
+    int      session_pool_idle; /*!< ms an idle session is kept*/
+    int64_t  mem_budget;        /*!< bytes of device memory of a shared device context, 0 no budget*/
+    int      mem_wait;          /*!< ms an allocation past mem_budget waits, 0 fails, -1 forever*/
 
     int trace_flag;
     int enable_crop;
@@ -75,18 +127,31 @@ typedef struct {
     /* null frame/packet received */
     int                draining;
     topscodecHandle_t  handle;
+    topscodecHandle_t  companion_handle;  // decodes the same stream into the companion frames
+    AVFifoBuffer*      companion_fifo;    // companion EFBuffers mapped ahead of their frame
+    AVBufferRef*       companion_frames;  // hw_frames_ctx of the companion frames
     topscodecDecCaps_t caps;
     char*              color_space; /*topscodecColorSpace_t*/
     topscodecType_t    codec_type;
     topscodecRunMode_t run_mode;
-    u32_t              stream_buf_size;
-    u64_t              stream_addr;
-    u64_t              mem_addr;
+    u32_t              stream_buf_size; /* one slot */
+    u64_t              stream_addr;     /* host address of the current slot */
+    u64_t              mem_addr;        /* device address of the current slot */
+    u64_t              stream_base;     /* stream_slot_num slots, in_port_num + 1 */
+    u64_t              mem_base;
+    int                stream_slot_num;
+    int                stream_slot;
+    u32_t              stream_buf_max; /* size handed to the codec at create */
+    /* outgrown buffers, the codec may still read queued packets from them until the handle goes */
+    u64_t   stream_retired[TOPSCODEC_STREAM_RETIRED_MAX];
+    int     stream_retired_nb;
+    int64_t stream_retired_bytes;
 
     enum AVPixelFormat output_pixfmt;
     char*              str_output_pixfmt;
 
     AVBufferRef*       hwdevice;
+    int                hwdevice_card; /* card of the shared device context, -1 when not from the cache */
     AVBufferRef*       hwframe;
     AVHWFramesContext* hwframes_ctx;
     AVCodecContext*    avctx;
@@ -97,26 +162,46 @@ typedef struct {
     AVFrame*      last_received_frame[MAX_FRAME_NUM];
     int           idx_put;           // for last_received_frame
     int           idx_get;           // for last_received_frame
-    AVFifoBuffer* mid_avframe_fifo;  // mid fifo
+    EFFrameRing   mid_frame_ring;    // mid ring, decode_callback -> receive_frame
+    atomic_int    mid_frame_abort;   // stop the producer waiting on a full ring
+    atomic_int    mid_frame_busy;    // decode_callback calls in flight
     AVFifoBuffer* avframe_fifo;      // flush fifo
     AVFifoBuffer* pkt_prop_fifo;     // frame prop fifo
+    EFFramePool   frame_pool;        // frames of the prop and flush fifos
 
-    EFBuffer* ef_buf_frame[MAX_FRAME_NUM];
-    EFBuffer* ef_buf_pkt;
+    AVBufferPool* ef_buf_pool;  // one EFBuffer per mapped frame
+    EFBuffer*     ef_buf_pkt;
+
+    int        coalesce;       // coalescing in effect for this stream
+    int        coalesce_nb;    // packets in the pending batch
+    int64_t    coalesce_start; // when the first packet of the batch arrived
+    EFPtsQueue coalesce_pts;
+
+    enum AVDiscard skip_frame;                       // skip_frame the codec params were last set for
+    int64_t        out_fps_slot;                     // 1/out_fps slot of the last kept frame
+    int            pp_applied[TOPSCODEC_PP_FIELDS];  // post processing options last set on the handle
+    int            pp_pending;                       // the handle refused a change, retried at the next key frame
 
     int64_t      last_send_pkt_time;
     volatile int decoder_start;
     volatile int decoder_init_flag;
 
+    /* signaled by decode_callback on every frame/bitstream/eos event */
+    pthread_mutex_t event_mutex;
+    pthread_cond_t  event_cond;
+    unsigned int    event_seq;
+    int             event_init;
+
     // AVMutex count_mutex;
-    unsigned long long total_frame_count;
-    unsigned long long total_packet_count;
+    atomic_ullong total_frame_count;
+    atomic_ullong total_packet_count;
 
     TopsCodecFunctions*    topscodec_lib_ctx;
     TopsRuntimesFunctions* topsruntime_lib_ctx;
-    int                    recv_first_frame;
-    int                    recv_outport_eos;
+    atomic_int             recv_first_frame;
+    atomic_int             recv_outport_eos;
     int                    first_packet;
+    int64_t                first_frame_deadline;  // recv_timeout counted from the first packet
     uint64_t               count;
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 18, 100)  // 3.x
     AVBSFContext* bsf;
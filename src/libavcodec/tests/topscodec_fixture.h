@@ -0,0 +1,197 @@
+/*
+ * shared fixture of the topscodec tests
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The plugin sources are compiled into the test, so it reaches their static
+ * functions, and the codec and runtime libraries are stubbed tables. The codec
+ * keeps the pts of the packets it is fed and maps them back in the same order
+ * as frames of plane_data, holding back codec.delay of them until the drain.
+ * Runtime memory is host memory. It counts the maps and unmaps, an unmap with
+ * a handle that is not the live one is counted apart. No device is needed.
+ */
+
+#ifndef AVCODEC_TESTS_TOPSCODEC_FIXTURE_H
+#define AVCODEC_TESTS_TOPSCODEC_FIXTURE_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "libavcodec/ff_topscodec_buffers.c"
+#include "libavcodec/ff_topscodec_dec.c"
+
+#define WIDTH  16
+#define HEIGHT 16
+
+/* only the thread that feeds the codec maps from it */
+static struct {
+    int64_t          pts[64];
+    int              head;
+    int              nb;
+    int              delay;
+    int              draining;
+    unsigned         nb_handles;
+    atomic_uintptr_t handle;  // the live handle, 0 once destroyed
+} codec;
+
+static uint8_t               plane_data[WIDTH * HEIGHT];
+static atomic_uint           nb_mapped;
+static atomic_uint           nb_unmapped;
+static atomic_uint           nb_bad_unmaps;
+static TopsCodecFunctions    codec_lib;
+static TopsRuntimesFunctions runtime_lib;
+
+static i32_t stub_get_version(u32_t* major, u32_t* minor, u32_t* patch) {
+    *major = 1;
+    *minor = 0;
+    *patch = 0;
+    return TOPSCODEC_SUCCESS;
+}
+
+static i32_t stub_get_caps(topscodecType_t type, u32_t card_id, u32_t device_id, topscodecDecCaps_t* caps) {
+    memset(caps, 0, sizeof(*caps));
+    caps->supported  = 1;
+    caps->max_width  = 4096;
+    caps->max_height = 4096;
+    return TOPSCODEC_SUCCESS;
+}
+
+static i32_t stub_create(topscodecHandle_t* handle, topscodecDecCreateInfo_t* info) {
+    codec.head     = 0;
+    codec.nb       = 0;
+    codec.draining = 0;
+    *handle        = (topscodecHandle_t)(uintptr_t)++codec.nb_handles;
+    atomic_store(&codec.handle, (uintptr_t)*handle);
+    return TOPSCODEC_SUCCESS;
+}
+
+static i32_t stub_set_params(topscodecHandle_t handle, topscodecDecParams_t* params) { return TOPSCODEC_SUCCESS; }
+
+static i32_t stub_destroy(topscodecHandle_t handle) {
+    if ((uintptr_t)handle == atomic_load(&codec.handle)) atomic_store(&codec.handle, 0);
+    return TOPSCODEC_SUCCESS;
+}
+
+static i32_t stub_decode_stream(topscodecHandle_t handle, topscodecStream_t* stream, i32_t timeout) {
+    if (!stream->data_len) {
+        codec.draining = 1;
+        return TOPSCODEC_SUCCESS;
+    }
+    if (codec.nb == FF_ARRAY_ELEMS(codec.pts)) return TOPSCODEC_ERROR_TIMEOUT;
+    codec.pts[(codec.head + codec.nb++) % FF_ARRAY_ELEMS(codec.pts)] = stream->pts;
+    return TOPSCODEC_SUCCESS;
+}
+
+/* a drained codec maps an empty frame, the EOS */
+static i32_t stub_frame_map(topscodecHandle_t handle, topscodecFrame_t* frame) {
+    memset(frame, 0, sizeof(*frame));
+    if (codec.draining && !codec.nb) return TOPSCODEC_SUCCESS;
+    if (!codec.nb || (codec.nb <= codec.delay && !codec.draining)) return TOPSCODEC_ERROR_BUFFER_EMPTY;
+    frame->width             = WIDTH;
+    frame->height            = HEIGHT;
+    frame->pixel_format      = TOPSCODEC_PIX_FMT_MONOCHROME;
+    frame->plane_num         = 1;
+    frame->plane[0].stride   = WIDTH;
+    frame->plane[0].dev_addr = (u64_t)(uintptr_t)plane_data;
+    frame->pts               = codec.pts[codec.head];
+    codec.head               = (codec.head + 1) % FF_ARRAY_ELEMS(codec.pts);
+    codec.nb--;
+    atomic_fetch_add(&nb_mapped, 1);
+    return TOPSCODEC_SUCCESS;
+}
+
+static i32_t stub_frame_unmap(topscodecHandle_t handle, topscodecFrame_t* frame) {
+    if (!handle || (uintptr_t)handle != atomic_load(&codec.handle)) {
+        atomic_fetch_add(&nb_bad_unmaps, 1);
+        return -1;
+    }
+    atomic_fetch_add(&nb_unmapped, 1);
+    return TOPSCODEC_SUCCESS;
+}
+
+static topsError_t stub_malloc(void** ptr, size_t size) { return (*ptr = av_malloc(size)) ? topsSuccess : -1; }
+
+static topsError_t stub_malloc_flags(void** ptr, size_t size, unsigned flags) { return stub_malloc(ptr, size); }
+
+static topsError_t stub_free(void* ptr) {
+    av_free(ptr);
+    return topsSuccess;
+}
+
+static topsError_t stub_pointer_attributes(topsPointerAttribute_t* att, const void* ptr) {
+    att->device_pointer = (void*)ptr;
+    return topsSuccess;
+}
+
+static topsError_t stub_memcpy_dev(void* dst, void* src, size_t size) {
+    memcpy(dst, src, size);
+    return topsSuccess;
+}
+
+static topsError_t stub_memcpy(void* dst, const void* src, size_t size, topsMemcpyKind kind) {
+    memcpy(dst, src, size);
+    return topsSuccess;
+}
+
+static topsError_t stub_set_device(int device) { return topsSuccess; }
+
+/* the decoder finds the codec table already loaded, the fixture keeps one reference for good */
+static void fixture_init(int delay) {
+    codec.delay                              = delay;
+    codec_lib.lib_topscodecGetLibVersion     = stub_get_version;
+    codec_lib.lib_topscodecDecGetCaps        = stub_get_caps;
+    codec_lib.lib_topscodecDecCreate         = stub_create;
+    codec_lib.lib_topscodecDecSetParams      = stub_set_params;
+    codec_lib.lib_topscodecDecDestroy        = stub_destroy;
+    codec_lib.lib_topscodecDecodeStream      = stub_decode_stream;
+    codec_lib.lib_topscodecDecFrameMap       = stub_frame_map;
+    codec_lib.lib_topscodecDecFrameUnmap     = stub_frame_unmap;
+    runtime_lib.lib_topsMalloc               = stub_malloc;
+    runtime_lib.lib_topsExtMallocWithFlags   = stub_malloc_flags;
+    runtime_lib.lib_topsFree                 = stub_free;
+    runtime_lib.lib_topsPointerGetAttributes = stub_pointer_attributes;
+    runtime_lib.lib_topsMemcpyHtoD           = stub_memcpy_dev;
+    runtime_lib.lib_topsMemcpyDtoD           = stub_memcpy_dev;
+    runtime_lib.lib_topsMemcpy               = stub_memcpy;
+    runtime_lib.lib_topsSetDevice            = stub_set_device;
+    g_codec_lib                              = &codec_lib;
+    g_codec_lib_ref                          = 1;
+}
+
+/* a device context on the stubbed runtime, it is not created by device_create so nothing is loaded */
+static AVBufferRef* fixture_device(void) {
+    AVBufferRef* ref = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_TOPSCODEC);
+
+    if (!ref) return NULL;
+    ((AVTOPSCodecDeviceContext*)((AVHWDeviceContext*)ref->data)->hwctx)->topsruntime_lib_ctx = &runtime_lib;
+    if (av_hwdevice_ctx_init(ref) < 0) av_buffer_unref(&ref);
+    return ref;
+}
+
+static int check_unmapped(const char* stage) {
+    unsigned mapped   = atomic_load(&nb_mapped);
+    unsigned unmapped = atomic_load(&nb_unmapped);
+
+    if (mapped == unmapped && !atomic_load(&nb_bad_unmaps)) return 0;
+    fprintf(stderr, "%s: %u mapped, %u unmapped, %u not with the live handle\n", stage, mapped, unmapped,
+            atomic_load(&nb_bad_unmaps));
+    return 1;
+}
+
+#endif /* AVCODEC_TESTS_TOPSCODEC_FIXTURE_H */
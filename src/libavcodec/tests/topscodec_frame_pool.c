@@ -0,0 +1,171 @@
+/*
+ * topscodec frame pool steady state test
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Opens the decoder on the stubbed codec of the fixture and runs NB_PACKETS
+ * packets through avcodec_send_packet()/avcodec_receive_frame(). Every
+ * FLUSH_INTERVAL packets a drain is cut short by a seek, so topscodec_flush()
+ * parks the frames still inside the codec in flush fifo frames, and they come
+ * out first after it. Prop frames and flush fifo frames come from the frame
+ * pool, once warmed up it must not allocate any more.
+ */
+
+#include "topscodec_fixture.h"
+
+#define NB_PACKETS     20000
+#define DELAY          3   /* frames the codec holds back for reordering */
+#define FLUSH_INTERVAL 500 /* packets between two seeks */
+#define WARMUP         (2 * FLUSH_INTERVAL)
+
+#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(59, 18, 100)
+#define DECODER (&ff_mpeg2_topscodec_decoder.p)
+#else
+#define DECODER (&ff_mpeg2_topscodec_decoder)
+#endif
+
+typedef struct {
+    AVCodecContext* avctx;
+    AVPacket*       pkt;
+    AVFrame*        frame;
+    unsigned        nb_frames;
+    int64_t         last_pts;
+    int             errors;
+} Decoder;
+
+static enum AVPixelFormat get_format(AVCodecContext* avctx, const enum AVPixelFormat* fmts) {
+    return AV_PIX_FMT_TOPSCODEC;
+}
+
+/* the frames the caller gets, parked ones included, keep the pts order */
+static int receive(Decoder* dec) {
+    int ret;
+
+    while ((ret = avcodec_receive_frame(dec->avctx, dec->frame)) >= 0) {
+        if ((dec->frame->pts <= dec->last_pts || dec->frame->width != WIDTH || !dec->frame->buf[0]) &&
+            dec->errors++ < 10)
+            fprintf(stderr, "frame %u: pts %" PRId64 " after %" PRId64 ", width %d\n", dec->nb_frames,
+                    dec->frame->pts, dec->last_pts, dec->frame->width);
+        dec->last_pts = dec->frame->pts;
+        dec->nb_frames++;
+        av_frame_unref(dec->frame);
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* the stubbed codec only looks at the size and the pts */
+static int decode(Decoder* dec, int64_t pts) {
+    static uint8_t data[8];
+    int            ret;
+
+    dec->pkt->data = data;
+    dec->pkt->size = sizeof(data);
+    dec->pkt->pts  = pts;
+    dec->pkt->dts  = pts;
+    ret            = avcodec_send_packet(dec->avctx, dec->pkt);
+    if (ret < 0) return ret;
+    return receive(dec);
+}
+
+/* the drain has started, the caller seeks instead of reading it to the end */
+static int seek(Decoder* dec) {
+    int ret = avcodec_send_packet(dec->avctx, NULL);
+
+    if (ret < 0) return ret;
+    avcodec_flush_buffers(dec->avctx);
+#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(59, 18, 100)
+    /* the FFCodec table has no flush callback */
+    topscodec_flush(dec->avctx);
+#endif
+    return 0;
+}
+
+int main(void) {
+    Decoder              dec     = {0};
+    AVBufferRef*         device  = NULL;
+    AVBufferRef*         frames  = NULL;
+    AVDictionary*        opts    = NULL;
+    EFCodecDecContext_t* ctx;
+    unsigned             allocs  = 0;
+    unsigned             nb_seek = 0;
+    int                  ret;
+
+    fixture_init(DELAY);
+    device    = fixture_device();
+    frames    = device ? av_hwframe_ctx_alloc(device) : NULL;
+    dec.avctx = avcodec_alloc_context3(DECODER);
+    dec.pkt   = av_packet_alloc();
+    dec.frame = av_frame_alloc();
+    if (!frames || !dec.avctx || !dec.pkt || !dec.frame) return 1;
+    ((AVHWFramesContext*)frames->data)->format    = AV_PIX_FMT_TOPSCODEC;
+    ((AVHWFramesContext*)frames->data)->sw_format = AV_PIX_FMT_GRAY8;
+    ((AVHWFramesContext*)frames->data)->width     = WIDTH;
+    ((AVHWFramesContext*)frames->data)->height    = HEIGHT;
+    if (av_hwframe_ctx_init(frames) < 0) return 1;
+
+    dec.avctx->width         = WIDTH;
+    dec.avctx->height        = HEIGHT;
+    dec.avctx->get_format    = get_format;
+    dec.avctx->hw_frames_ctx = av_buffer_ref(frames);
+    dec.last_pts             = -1;
+    av_dict_set(&opts, "output_pixfmt", "gray", 0);
+    ret = avcodec_open2(dec.avctx, DECODER, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "open failed: %d\n", ret);
+        return 1;
+    }
+    ctx = dec.avctx->priv_data;
+
+    for (int64_t pts = 0; pts < NB_PACKETS && ret >= 0; pts++) {
+        if (pts == WARMUP) allocs = ctx->frame_pool.nb_allocs;
+        ret = decode(&dec, pts);
+        if (ret >= 0 && pts % FLUSH_INTERVAL == FLUSH_INTERVAL - 1) {
+            ret = seek(&dec);
+            nb_seek++;
+        }
+    }
+    if (ret >= 0) ret = avcodec_send_packet(dec.avctx, NULL);
+    if (ret >= 0) ret = receive(&dec);
+    if (ret < 0) {
+        fprintf(stderr, "decode failed: %d\n", ret);
+        dec.errors++;
+    }
+    if (ctx->frame_pool.nb_allocs != allocs) {
+        fprintf(stderr, "%u frame allocations after warm-up, %u before\n", ctx->frame_pool.nb_allocs - allocs,
+                allocs);
+        dec.errors++;
+    }
+    /* a seek drops at most the frame avcodec_send_packet() buffered for the drain */
+    if (dec.nb_frames + nb_seek < NB_PACKETS) {
+        fprintf(stderr, "%u frames of %d packets, %u seeks\n", dec.nb_frames, NB_PACKETS, nb_seek);
+        dec.errors++;
+    }
+    if (!dec.errors)
+        printf("%u frames, %u pool gets, %u allocations\n", dec.nb_frames, ctx->frame_pool.nb_gets,
+               ctx->frame_pool.nb_allocs);
+
+    av_packet_free(&dec.pkt);
+    av_frame_free(&dec.frame);
+    avcodec_free_context(&dec.avctx);
+    av_buffer_unref(&frames);
+    av_buffer_unref(&device);
+    dec.errors += check_unmapped("close");
+    return !!dec.errors;
+}
@@ -0,0 +1,153 @@
+/*
+ * topscodec frame ring stress test
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * One thread plays decode_callback() and pushes mapped frames into the
+ * EFFrameRing, the main thread plays receive_frame() and pops them. The
+ * stubbed codec of the fixture numbers the frames it maps and counts the
+ * unmaps, so lost, duplicated or reordered frames and leaked or late
+ * mappings all show up.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "topscodec_fixture.h"
+
+#define NB_FRAMES 1000000
+#define NB_SLOTS  8
+
+typedef struct {
+    EFFrameRing*         ring;
+    AVBufferPool*        pool;
+    EFCodecDecContext_t* ctx;
+    unsigned             nb_frames;
+    int                  ret;
+} Producer;
+
+/* what decode_callback() does for TOPSCODEC_EVENT_NEW_FRAME, without a frames context */
+static void* producer_thread(void* arg) {
+    Producer* p = arg;
+
+    for (unsigned i = 0; i < p->nb_frames; i++) {
+        /* every frame gets the next number as its pts */
+        topscodecStream_t stream = {.data_len = 1, .pts = atomic_load(&nb_mapped)};
+        AVFrame*          slot;
+        EFBuffer*         efbuf;
+
+        while (!(slot = ff_topscodec_ring_write_slot(p->ring))) sched_yield();
+        efbuf = ff_topscodec_efbuf_get(p->pool, NULL, p->ctx);
+        if (!efbuf) {
+            p->ret = AVERROR(ENOMEM);
+            return NULL;
+        }
+        efbuf->handle = p->ctx->handle;
+        efbuf->lib    = p->ctx->topscodec_lib_ctx;
+        p->ctx->topscodec_lib_ctx->lib_topscodecDecodeStream(p->ctx->handle, &stream, 0);
+        p->ctx->topscodec_lib_ctx->lib_topscodecDecFrameMap(p->ctx->handle, &efbuf->ef_frame);
+        p->ret = ff_topscodec_efbuf_to_companion(efbuf, slot);
+        ff_topscodec_efbuf_unref(efbuf);
+        if (p->ret < 0) return NULL;
+        ff_topscodec_ring_write_commit(p->ring);
+    }
+    return NULL;
+}
+
+/* pop nb_frames frames, they have to come in order starting at *next */
+static int consume(EFFrameRing* ring, unsigned nb_frames, unsigned* next) {
+    int errors = 0;
+
+    while (nb_frames > 0) {
+        AVFrame* frame = ff_topscodec_ring_read_slot(ring);
+
+        if (!frame) {
+            sched_yield();
+            continue;
+        }
+        if (frame->pts != *next || frame->width != WIDTH || frame->height != HEIGHT || !frame->buf[0]) {
+            if (errors++ < 10)
+                fprintf(stderr, "frame %u: pts %" PRId64 ", %dx%d\n", *next, frame->pts, frame->width,
+                        frame->height);
+        }
+        (*next)++;
+        av_frame_unref(frame);
+        ff_topscodec_ring_read_commit(ring);
+        nb_frames--;
+    }
+    return errors;
+}
+
+static int run(EFFrameRing* ring, Producer* p, unsigned nb_frames, unsigned* next) {
+    pthread_t thread;
+    int       errors;
+
+    p->nb_frames = nb_frames;
+    p->ret       = 0;
+    if (pthread_create(&thread, NULL, producer_thread, p)) return 1;
+    errors = consume(ring, nb_frames, next);
+    pthread_join(thread, NULL);
+    if (p->ret < 0) {
+        fprintf(stderr, "producer failed: %d\n", p->ret);
+        errors++;
+    }
+    return errors;
+}
+
+int main(void) {
+    EFCodecDecContext_t* ctx    = av_mallocz(sizeof(*ctx));
+    AVBufferPool*        pool   = av_buffer_pool_init(sizeof(EFBuffer), NULL);
+    EFFrameRing          ring   = {0};
+    Producer             p      = {0};
+    unsigned             next   = 0;
+    int                  errors = 0;
+
+    if (!ctx || !pool || ff_topscodec_ring_init(&ring, NB_SLOTS) < 0) return 1;
+    fixture_init(0);
+    ctx->topscodec_lib_ctx = &codec_lib;
+    codec_lib.lib_topscodecDecCreate(&ctx->handle, NULL);
+    p.ring = &ring;
+    p.pool = pool;
+    p.ctx  = ctx;
+
+    /* both sides flat out, the ring is full or empty most of the time */
+    errors += run(&ring, &p, NB_FRAMES, &next);
+    errors += check_unmapped("stream");
+
+    /* fill the ring and drop it the way a flush does, the handle is still there */
+    p.nb_frames = NB_SLOTS;
+    producer_thread(&p);
+    if (ff_topscodec_ring_count(&ring) != NB_SLOTS) {
+        fprintf(stderr, "full ring holds %u frames\n", ff_topscodec_ring_count(&ring));
+        errors++;
+    }
+    ff_topscodec_ring_reset(&ring);
+    next = atomic_load(&nb_mapped);
+    errors += check_unmapped("reset");
+
+    /* and the ring works as before once reset */
+    errors += run(&ring, &p, NB_FRAMES / 10, &next);
+    errors += check_unmapped("after reset");
+
+    ff_topscodec_ring_uninit(&ring);
+    av_buffer_pool_uninit(&pool);
+    av_free(ctx);
+    if (!errors) printf("%u frames through a %u slot ring\n", atomic_load(&nb_mapped), NB_SLOTS);
+    return !!errors;
+}
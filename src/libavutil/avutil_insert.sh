@@ -208,4 +208,11 @@ PIX_FILE='pixfmt.h'
 sed -i "/${PIX_END}/i \
 ${RGB24P}\
 ${BGR24P}\
-${EFCODEC}" ${PIX_FILE}
\ No newline at end of file
+${EFCODEC}" ${PIX_FILE}
+
+#frame.h
+SD_TYPE='\t/**\n\t * enflame companion frame, data is an AVTOPSCodecCompanion (hwcontext_topscodec.h), a downscaled copy of this frame\n\t */\n\tAV_FRAME_DATA_TOPSCODEC_COMPANION,'
+SD_FILE='frame.h'
+
+#在 enum AVFrameSideDataType 末尾插入，不改变已有类型的值
+sed -i "/enum${WS}AVFrameSideDataType${WS}{/,/^};/ s|^};|${SD_TYPE}\n};|" ${SD_FILE}
@@ -36,12 +36,95 @@
 #include "mem.h"
 #include "pixdesc.h"
 #include "pixfmt.h"
+#include "time.h"
 #include "version.h"
 
 #define TOPSCODEC_FRAME_ALIGNMENT 1  // tops align
+#define TOPSCODEC_SUBPOOL_MAX     8          // size classes a device keeps buffers for
+#define TOPSCODEC_SLAB_SIZE       (32 << 20)  // bytes one topsMalloc carves into frame buffers
+#define TOPSCODEC_SLAB_ALIGN      256        // frame buffer alignment inside a slab
+#define TOPSCODEC_MEM_WAIT_SLICE  10000      // us, a blocked pool also looks for its own frames coming back
 
 static pthread_mutex_t g_hw_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* the runtime symbol table is shared by all device contexts, refcounted under g_hw_mutex */
+static TopsRuntimesFunctions* g_runtime_lib     = NULL;
+static int                    g_runtime_lib_ref = 0;
+
+/*
+ * Device memory is pooled per device by size class, not per frames context.
+ * A frames context draws its buffers from the sub-pool of its size class, and
+ * gives them back when it goes, so a stream that switches between sizes, or a
+ * new frames context of a size seen before, recycles buffers instead of going
+ * through topsFree/topsMalloc again.
+ */
+typedef struct {
+    AVHWDeviceContext* device_ctx;
+    AVBufferPool*      pool;
+    int                size;
+    int                alignment;  // AVTOPSCodecFramesContext.alignment of its frames contexts
+    unsigned           flags;
+    unsigned           last_used;
+} TOPSCodecSubPool;
+
+/*
+ * The sub-pools do not topsMalloc each buffer, they carve it out of a slab, one
+ * large device allocation split into equal chunks of one size class. A slab is
+ * freed when its last chunk comes back, so evicted classes still return memory.
+ * The base is aligned to the alignment of the slab and the chunk size is a
+ * multiple of it, so every chunk starts on an aligned device address.
+ */
+typedef struct TOPSCodecSlab {
+    struct TOPSCodecSlab* next;
+    AVHWDeviceContext*    device_ctx;
+    uint8_t*              data;  // what topsMalloc returned
+    uint8_t*              base;  // data aligned up
+    int64_t               size;  // bytes allocated, base padding included
+    unsigned              flags;
+    int                   alignment;
+    int                   chunk_size;
+    int                   nb_chunks;
+    int                   nb_free;
+    int*                  free_chunks;  // stack of free chunk indexes
+} TOPSCodecSlab;
+
+typedef struct {
+    pthread_mutex_t  lock;
+    int              lock_init;
+    TOPSCodecSubPool subpools[TOPSCODEC_SUBPOOL_MAX];
+    int              nb_subpools;
+    unsigned         clock;
+    int              budget_hit;  // the last sub-pool allocation was over the budget, under lock
+
+    /* slabs, under slab_lock, the sub-pools allocate while holding lock */
+    pthread_mutex_t slab_lock;
+    TOPSCodecSlab*  slabs;
+    int             slab_size;
+    int             slab_align;
+
+    /* statistics, under slab_lock */
+    int64_t  slab_bytes;
+    int64_t  slab_bytes_peak;
+    int      chunks_used;
+    unsigned nb_slab_allocs;
+    unsigned nb_slab_frees;
+
+    /* accounting, under mem_lock, mem_cond is signalled when memory comes back */
+    pthread_mutex_t mem_lock;
+    pthread_cond_t  mem_cond;
+    int64_t         mem_used[AV_TOPSCODEC_MEM_NB];
+    int64_t         mem_total;
+    int64_t         mem_peak;
+    int64_t         mem_budget;  // 0 means no budget
+    int             mem_wait;    // ms, 0 fails at once, -1 waits forever
+    void (*reclaim)(AVHWDeviceContext* ctx);
+} TOPSCodecDevicePriv;
+
+typedef struct {
+    int nb_buffers;  // allocated by the frames pool, under the pool lock
+    int budget_hit;  // the last allocation of the pool was over the budget
+} TOPSCodecFramesPriv;
+
 #if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(56, 14, 100)  // n3.x do not support AV_PIX_FMT_GRAY10BE
 static const enum AVPixelFormat supported_formats[] = {AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12,    AV_PIX_FMT_NV21,
                                                        AV_PIX_FMT_RGB24,   AV_PIX_FMT_RGB24P,  AV_PIX_FMT_BGR24,
@@ -75,38 +158,345 @@ static int topscodec_frames_get_constraints(AVHWDeviceContext* ctx, const void*
     return 0;
 }
 
-static void topscodec_buffer_free(void* opaque, uint8_t* data) {
-    AVHWFramesContext*        ctx        = (AVHWFramesContext*)opaque;
-    AVHWDeviceContext*        device_ctx = ctx->device_ctx;
+static void topscodec_slab_free(TOPSCodecSlab* slab) {
+    AVHWDeviceContext*        device_ctx = slab->device_ctx;
     AVTOPSCodecDeviceContext* tops_ctx   = device_ctx->hwctx;
-    tops_ctx->topsruntime_lib_ctx->lib_topsFree((void*)data);
-    av_log(ctx, AV_LOG_DEBUG, "pool buffer topsFree.\n");
+
+    tops_ctx->topsruntime_lib_ctx->lib_topsFree(slab->data);
+    av_topscodec_mem_release(device_ctx, AV_TOPSCODEC_MEM_FRAMES, slab->size);
+    av_log(device_ctx, AV_LOG_DEBUG, "slab topsFree addr:%p, %d x %d\n", slab->data, slab->nb_chunks,
+           slab->chunk_size);
+    av_free(slab->free_chunks);
+    av_free(slab);
 }
 
-static AVBufferRef* topscodec_pool_alloc(void* opaque, int size) {
-    AVHWFramesContext*        ctx        = (AVHWFramesContext*)opaque;
-    AVHWDeviceContext*        device_ctx = ctx->device_ctx;
-    AVTOPSCodecDeviceContext* tops_ctx   = device_ctx->hwctx;
+/* account the memory if the budget allows it, never waits */
+static int topscodec_mem_try_reserve(TOPSCodecDevicePriv* priv, enum AVTOPSCodecMemType type, int64_t size,
+                                     int flags) {
+    int ret = 0;
+
+    pthread_mutex_lock(&priv->mem_lock);
+    if (!(flags & AV_TOPSCODEC_MEM_FORCE) && priv->mem_budget && priv->mem_total + size > priv->mem_budget) {
+        ret = AVERROR(ENOMEM);
+    } else {
+        priv->mem_used[type] += size;
+        priv->mem_total += size;
+        priv->mem_peak = FFMAX(priv->mem_peak, priv->mem_total);
+    }
+    pthread_mutex_unlock(&priv->mem_lock);
+    return ret;
+}
+
+/*
+ * wait for memory to come back, in slices: a blocked frames pool also gets
+ * going again by its own frames coming back, which does not signal mem_cond
+ */
+static int topscodec_mem_wait(TOPSCodecDevicePriv* priv, int64_t deadline) {
+    int64_t         now = av_gettime();
+    int64_t         until;
+    struct timespec ts;
+
+    if (!priv->mem_wait || (priv->mem_wait > 0 && now >= deadline)) return AVERROR(ETIMEDOUT);
+    until = now + TOPSCODEC_MEM_WAIT_SLICE;
+    if (priv->mem_wait > 0) until = FFMIN(until, deadline);
+    ts.tv_sec  = until / 1000000;
+    ts.tv_nsec = until % 1000000 * 1000;
+
+    pthread_mutex_lock(&priv->mem_lock);
+    pthread_cond_timedwait(&priv->mem_cond, &priv->mem_lock, &ts);
+    pthread_mutex_unlock(&priv->mem_lock);
+    return 0;
+}
+
+/*
+ * Over the budget, give back what nobody uses before waiting: the idle buffers
+ * of the sub-pools, their empty slabs are freed with them, and whatever the
+ * reclaim callback frees. Buffers still out go when the last of their sub-pool
+ * is back. Called without lock, it takes it.
+ */
+static void topscodec_mem_reclaim(AVHWDeviceContext* ctx) {
+    TOPSCodecDevicePriv* priv = ctx->internal->priv;
+    AVBufferPool*        pools[TOPSCODEC_SUBPOOL_MAX];
+    void (*reclaim)(AVHWDeviceContext* ctx);
+    int nb;
+    int i;
+
+    pthread_mutex_lock(&priv->lock);
+    nb = priv->nb_subpools;
+    for (i = 0; i < nb; i++) pools[i] = priv->subpools[i].pool;
+    priv->nb_subpools = 0;
+    pthread_mutex_unlock(&priv->lock);
+    for (i = 0; i < nb; i++) av_buffer_pool_uninit(&pools[i]);
+
+    pthread_mutex_lock(&priv->mem_lock);
+    reclaim = priv->reclaim;
+    pthread_mutex_unlock(&priv->mem_lock);
+    if (reclaim) reclaim(ctx);
+    av_log(ctx, AV_LOG_VERBOSE, "over the memory budget, %d idle sub-pools released\n", nb);
+}
+
+int av_topscodec_mem_reserve(AVHWDeviceContext* ctx, enum AVTOPSCodecMemType type, int64_t size, int flags) {
+    TOPSCodecDevicePriv* priv     = ctx->internal->priv;
+    int64_t              deadline = av_gettime() + priv->mem_wait * 1000LL;
+    int                  ret;
 
-    AVBufferRef* ref  = NULL;
-    void*        data = NULL;
-    int          ret  = 0;
+    if (type < 0 || type >= AV_TOPSCODEC_MEM_NB || size < 0) return AVERROR(EINVAL);
 
-    ret = tops_ctx->topsruntime_lib_ctx->lib_topsMalloc(&data, size);
+    ret = topscodec_mem_try_reserve(priv, type, size, flags);
+    if (ret < 0 && size <= priv->mem_budget) {
+        topscodec_mem_reclaim(ctx);
+        while ((ret = topscodec_mem_try_reserve(priv, type, size, flags)) < 0)
+            if (topscodec_mem_wait(priv, deadline) < 0) break;
+    }
+    if (ret < 0)
+        av_log(ctx, AV_LOG_ERROR, "device memory budget %" PRId64 " exceeded, %" PRId64 " in use, %" PRId64 " asked\n",
+               priv->mem_budget, priv->mem_total, size);
+    return ret;
+}
+
+void av_topscodec_mem_release(AVHWDeviceContext* ctx, enum AVTOPSCodecMemType type, int64_t size) {
+    TOPSCodecDevicePriv* priv = ctx->internal->priv;
+
+    if (type < 0 || type >= AV_TOPSCODEC_MEM_NB) return;
+    pthread_mutex_lock(&priv->mem_lock);
+    priv->mem_used[type] -= size;
+    priv->mem_total -= size;
+    pthread_cond_broadcast(&priv->mem_cond);
+    pthread_mutex_unlock(&priv->mem_lock);
+}
+
+void av_topscodec_mem_usage(AVHWDeviceContext* ctx, int64_t* usage) {
+    TOPSCodecDevicePriv* priv = ctx->internal->priv;
+
+    pthread_mutex_lock(&priv->mem_lock);
+    memcpy(usage, priv->mem_used, sizeof(priv->mem_used));
+    pthread_mutex_unlock(&priv->mem_lock);
+}
+
+void av_topscodec_mem_set_reclaim(AVHWDeviceContext* ctx, void (*reclaim)(AVHWDeviceContext* ctx)) {
+    TOPSCodecDevicePriv* priv = ctx->internal->priv;
+
+    pthread_mutex_lock(&priv->mem_lock);
+    priv->reclaim = reclaim;
+    pthread_mutex_unlock(&priv->mem_lock);
+}
+
+/*
+ * called with lock held and without slab_lock, over the budget it fails and sets budget_hit.
+ * chunk_size is a multiple of alignment.
+ */
+static TOPSCodecSlab* topscodec_slab_new(AVHWDeviceContext* ctx, int chunk_size, int alignment, unsigned flags) {
+    AVTOPSCodecDeviceContext* tops_ctx = ctx->hwctx;
+    TOPSCodecDevicePriv*      priv     = ctx->internal->priv;
+    TOPSCodecSlab*            slab;
+    void*                     data = NULL;
+    size_t                    size;
+    int                       ret;
+    int                       i;
+
+    slab = av_mallocz(sizeof(*slab));
+    if (!slab) return NULL;
+    slab->device_ctx  = ctx;
+    slab->flags       = flags;
+    slab->alignment   = alignment;
+    slab->chunk_size  = chunk_size;
+    slab->nb_chunks   = FFMAX(1, priv->slab_size / chunk_size);
+    slab->free_chunks = av_malloc_array(slab->nb_chunks, sizeof(*slab->free_chunks));
+    if (!slab->free_chunks) {
+        av_free(slab);
+        return NULL;
+    }
+
+    /* topsMalloc only guarantees its own alignment, pad for the base to be moved up */
+    size = (size_t)slab->nb_chunks * chunk_size + alignment - 1;
+    if (topscodec_mem_try_reserve(priv, AV_TOPSCODEC_MEM_FRAMES, size, 0) < 0) {
+        priv->budget_hit = 1;
+        av_free(slab->free_chunks);
+        av_free(slab);
+        return NULL;
+    }
+    if (flags)
+        ret = tops_ctx->topsruntime_lib_ctx->lib_topsExtMallocWithFlags(&data, size, flags);
+    else
+        ret = tops_ctx->topsruntime_lib_ctx->lib_topsMalloc(&data, size);
     if (ret != topsSuccess) {
-        av_log(ctx, AV_LOG_ERROR, "topscodec_malloc failed: dev addr %p, size %d \n", data, size);
+        av_log(ctx, AV_LOG_ERROR, "topscodec_malloc failed: dev addr %p, size %zu \n", data, size);
+        av_topscodec_mem_release(ctx, AV_TOPSCODEC_MEM_FRAMES, size);
+        av_free(slab->free_chunks);
+        av_free(slab);
+        return NULL;
+    }
+    av_log(ctx, AV_LOG_DEBUG, "slab topsMalloc addr:%p, %d x %d\n", data, slab->nb_chunks, chunk_size);
+
+    slab->data = data;
+    slab->base = (uint8_t*)FFALIGN((uintptr_t)data, alignment);
+    slab->size = size;
+    /* hand out the lowest chunks first */
+    for (i = 0; i < slab->nb_chunks; i++) slab->free_chunks[i] = slab->nb_chunks - 1 - i;
+    slab->nb_free = slab->nb_chunks;
+    return slab;
+}
+
+/* returns a chunk to its slab, opaque is the slab */
+static void topscodec_buffer_free(void* opaque, uint8_t* data) {
+    TOPSCodecSlab*       slab = (TOPSCodecSlab*)opaque;
+    TOPSCodecDevicePriv* priv = slab->device_ctx->internal->priv;
+    TOPSCodecSlab**      p;
+
+    pthread_mutex_lock(&priv->slab_lock);
+    slab->free_chunks[slab->nb_free++] = (data - slab->base) / slab->chunk_size;
+    priv->chunks_used--;
+    if (slab->nb_free == slab->nb_chunks) {
+        for (p = &priv->slabs; *p != slab; p = &(*p)->next)
+            ;
+        *p = slab->next;
+        priv->nb_slab_frees++;
+        priv->slab_bytes -= slab->size;
+    } else {
+        slab = NULL;
+    }
+    pthread_mutex_unlock(&priv->slab_lock);
+
+    if (slab) topscodec_slab_free(slab);
+}
+
+/* sub-pool allocator, opaque is the sub-pool, called with the device lock held */
+static AVBufferRef* topscodec_pool_alloc(void* opaque, int size) {
+    TOPSCodecSubPool*    sub        = (TOPSCodecSubPool*)opaque;
+    AVHWDeviceContext*   ctx        = sub->device_ctx;
+    TOPSCodecDevicePriv* priv       = ctx->internal->priv;
+    int                  alignment  = FFMAX(sub->alignment, priv->slab_align);
+    int                  chunk_size = FFALIGN(size, alignment);
+    TOPSCodecSlab*       slab;
+    AVBufferRef*         ref;
+    uint8_t*             data;
+
+    pthread_mutex_lock(&priv->slab_lock);
+    for (slab = priv->slabs; slab; slab = slab->next)
+        if (slab->chunk_size == chunk_size && slab->flags == sub->flags && slab->alignment >= alignment &&
+            slab->nb_free)
+            break;
+    if (!slab) {
+        /* frees only need slab_lock, they do not wait for the device allocation */
+        pthread_mutex_unlock(&priv->slab_lock);
+        slab = topscodec_slab_new(ctx, chunk_size, alignment, sub->flags);
+        if (!slab) return NULL;
+        pthread_mutex_lock(&priv->slab_lock);
+        slab->next  = priv->slabs;
+        priv->slabs = slab;
+        priv->nb_slab_allocs++;
+        priv->slab_bytes += slab->size;
+        priv->slab_bytes_peak = FFMAX(priv->slab_bytes_peak, priv->slab_bytes);
+    }
+    data = slab->base + (size_t)slab->free_chunks[--slab->nb_free] * chunk_size;
+    priv->chunks_used++;
+    pthread_mutex_unlock(&priv->slab_lock);
+
+    ref = av_buffer_create(data, size, topscodec_buffer_free, slab, 0);
+    if (!ref) topscodec_buffer_free(slab, data);
+    return ref;
+}
+
+/* round up to 1/8..1/16 of the size, close sizes (crop windows) share a class */
+static int topscodec_size_class(int size) {
+    int step = 4096;
+
+    while (step * 8 < size) step *= 2;
+    return FFALIGN(size, step);
+}
+
+/* the buffer of the sub-pool of class_size, sets *budget_hit when its slab was over the budget */
+static AVBufferRef* topscodec_subpool_get(AVHWFramesContext* ctx, int class_size, int* budget_hit) {
+    AVTOPSCodecFramesContext* hwctx      = ctx->hwctx;
+    AVHWDeviceContext*        device_ctx = ctx->device_ctx;
+    TOPSCodecDevicePriv*      priv       = device_ctx->internal->priv;
+    TOPSCodecSubPool*         sub        = NULL;
+    AVBufferPool*             evicted    = NULL;
+    AVBufferRef*              ref;
+    int                       i;
+
+    pthread_mutex_lock(&priv->lock);
+    for (i = 0; i < priv->nb_subpools; i++) {
+        if (priv->subpools[i].size == class_size && priv->subpools[i].flags == hwctx->flags &&
+            priv->subpools[i].alignment == hwctx->alignment) {
+            sub = &priv->subpools[i];
+            break;
+        }
+    }
+    if (!sub) {
+        if (priv->nb_subpools < TOPSCODEC_SUBPOOL_MAX) {
+            sub = &priv->subpools[priv->nb_subpools++];
+        } else {
+            /* the least recently used class goes, buffers still out are freed when they come back */
+            sub = &priv->subpools[0];
+            for (i = 1; i < priv->nb_subpools; i++)
+                if (priv->subpools[i].last_used < sub->last_used) sub = &priv->subpools[i];
+            evicted = sub->pool;
+        }
+        sub->device_ctx = device_ctx;
+        sub->size       = class_size;
+        sub->alignment  = hwctx->alignment;
+        sub->flags      = hwctx->flags;
+        sub->pool       = av_buffer_pool_init2(class_size, sub, topscodec_pool_alloc, NULL);
+        av_log(ctx, AV_LOG_DEBUG, "new sub-pool, size class:%d for %dx%d\n", class_size, ctx->width, ctx->height);
+    }
+    sub->last_used   = ++priv->clock;
+    priv->budget_hit = 0;
+    ref              = sub->pool ? av_buffer_pool_get(sub->pool) : NULL;
+    *budget_hit      = priv->budget_hit;
+    if (!sub->pool) sub->size = 0;
+    pthread_mutex_unlock(&priv->lock);
+
+    av_buffer_pool_uninit(&evicted);
+    return ref;
+}
+
+/*
+ * frames pool allocator, opaque is the frames context, the buffer comes from the device sub-pool.
+ * It runs under the lock of the frames pool and never waits for the budget, topscodec_get_buffer() does.
+ */
+static AVBufferRef* topscodec_frames_pool_alloc(void* opaque, int size) {
+    AVHWFramesContext*        ctx         = (AVHWFramesContext*)opaque;
+    AVTOPSCodecFramesContext* hwctx       = ctx->hwctx;
+    TOPSCodecFramesPriv*      frames_priv = ctx->internal->priv;
+    AVBufferRef*              ref;
+    int                       class_size = topscodec_size_class(size);
+    int                       budget_hit = 0;
+
+    frames_priv->budget_hit = 0;
+    if (hwctx->max_pool_size && frames_priv->nb_buffers >= hwctx->max_pool_size) {
+        av_log(ctx, AV_LOG_WARNING, "all %d buffers of the pool are in use\n", hwctx->max_pool_size);
         return NULL;
     }
-    av_log(ctx, AV_LOG_DEBUG, "pool topsMalloc size:%d, addr:%p\n", size, data);
-    ref = av_buffer_create((uint8_t*)data, size, topscodec_buffer_free, ctx, 0);
-    if (!ref) {
-        tops_ctx->topsruntime_lib_ctx->lib_topsFree(data);
+    if (hwctx->alignment) class_size = FFALIGN(class_size, hwctx->alignment);
+
+    ref = topscodec_subpool_get(ctx, class_size, &budget_hit);
+    if (!ref && budget_hit) {
+        /* idle memory of the device goes before this pool blocks */
+        topscodec_mem_reclaim(ctx->device_ctx);
+        ref = topscodec_subpool_get(ctx, class_size, &budget_hit);
     }
+    if (ref)
+        frames_priv->nb_buffers++;
+    else
+        frames_priv->budget_hit = budget_hit;
     return ref;
 }
 
 static int topscodec_frames_init(AVHWFramesContext* ctx) {
-    int i;
+    AVTOPSCodecFramesContext* hwctx = ctx->hwctx;
+    int                       i;
+
+    if (hwctx->max_pool_size < 0 || hwctx->alignment < 0 || (hwctx->alignment & (hwctx->alignment - 1))) {
+        av_log(ctx, AV_LOG_ERROR, "Invalid max_pool_size %d or alignment %d\n", hwctx->max_pool_size,
+               hwctx->alignment);
+        return AVERROR(EINVAL);
+    }
+    if (hwctx->max_pool_size && ctx->initial_pool_size > hwctx->max_pool_size) {
+        av_log(ctx, AV_LOG_ERROR, "initial_pool_size %d is larger than max_pool_size %d\n", ctx->initial_pool_size,
+               hwctx->max_pool_size);
+        return AVERROR(EINVAL);
+    }
 
     for (i = 0; i < FF_ARRAY_ELEMS(supported_formats); i++) {
         if (ctx->sw_format == supported_formats[i]) break;
@@ -120,7 +510,7 @@ static int topscodec_frames_init(AVHWFramesContext* ctx) {
         int size = av_image_get_buffer_size(ctx->sw_format, ctx->width, ctx->height, TOPSCODEC_FRAME_ALIGNMENT);
         if (size < 0) return size;
 
-        ctx->internal->pool_internal = av_buffer_pool_init2(size, ctx, topscodec_pool_alloc, NULL);
+        ctx->internal->pool_internal = av_buffer_pool_init2(size, ctx, topscodec_frames_pool_alloc, NULL);
         if (!ctx->internal->pool_internal) return AVERROR(ENOMEM);
     }
 
@@ -128,10 +518,21 @@ static int topscodec_frames_init(AVHWFramesContext* ctx) {
 }
 
 static int topscodec_get_buffer(AVHWFramesContext* ctx, AVFrame* frame) {
-    int res;
+    TOPSCodecFramesPriv* frames_priv = ctx->internal->priv;
+    TOPSCodecDevicePriv* priv        = ctx->device_ctx->internal->priv;
+    int64_t              deadline    = av_gettime() + priv->mem_wait * 1000LL;
+    int                  res;
+
     /*when unref frame buf, buf[0] can unref pool buf*/
-    frame->buf[0] = av_buffer_pool_get(ctx->pool);
-    if (!frame->buf[0]) return AVERROR(ENOMEM);
+    /* over the budget the pool blocks here, no lock held, until memory or one of its frames comes back */
+    while (!(frame->buf[0] = av_buffer_pool_get(ctx->pool))) {
+        if (!frames_priv->budget_hit) return AVERROR(ENOMEM);
+        if (topscodec_mem_wait(priv, deadline) < 0) {
+            av_log(ctx, AV_LOG_ERROR, "device memory budget %" PRId64 " exceeded, no frame buffer\n",
+                   priv->mem_budget);
+            return AVERROR(ENOMEM);
+        }
+    }
 
     res = av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, ctx->sw_format, ctx->width,
                                ctx->height, TOPSCODEC_FRAME_ALIGNMENT);
@@ -239,21 +640,109 @@ static int topscodec_transfer_data(AVHWFramesContext* ctx, AVFrame* dst, const A
     return 0;
 }
 
+/* the buffer of frame->extended_buf that data points into */
+static AVBufferRef* topscodec_extended_buf(const AVFrame* frame, const uint8_t* data) {
+    for (int i = 0; i < frame->nb_extended_buf; i++) {
+        AVBufferRef* buf = frame->extended_buf[i];
+        if (data >= buf->data && data < buf->data + buf->size) return buf;
+    }
+    return NULL;
+}
+
+int av_topscodec_companion_frame(const AVFrame* frame, AVFrame* companion) {
+    const AVFrameSideData*      sd = av_frame_get_side_data(frame, AV_FRAME_DATA_TOPSCODEC_COMPANION);
+    const AVTOPSCodecCompanion* c;
+    AVBufferRef*                buf;
+    int                         i;
+
+    if (!sd || sd->size < sizeof(*c)) return AVERROR(ENOENT);
+    c = (const AVTOPSCodecCompanion*)sd->data;
+    av_frame_unref(companion);
+    for (i = 0; i < FF_ARRAY_ELEMS(c->data) && c->data[i]; i++) {
+        buf = topscodec_extended_buf(frame, c->data[i]);
+        if (!buf) goto fail;
+        companion->buf[i] = av_buffer_ref(buf);
+        if (!companion->buf[i]) goto fail;
+        companion->data[i]     = c->data[i];
+        companion->linesize[i] = c->linesize[i];
+    }
+    buf = c->frames ? topscodec_extended_buf(frame, (const uint8_t*)c->frames) : NULL;
+    if (!buf) goto fail;
+    companion->hw_frames_ctx = av_buffer_ref(buf);
+    if (!companion->hw_frames_ctx) goto fail;
+    /* like the frames of the decoder, format is the software format of the planes */
+    companion->format = c->format;
+    companion->width  = c->width;
+    companion->height = c->height;
+    companion->pts    = c->pts;
+    return 0;
+
+fail:
+    av_frame_unref(companion);
+    return buf ? AVERROR(ENOMEM) : AVERROR(EINVAL);
+}
+
 static int topscodec_device_init(AVHWDeviceContext* device_ctx) {
-    int                       ret = 0;
-    AVTOPSCodecDeviceContext* ctx = device_ctx->hwctx;
+    int                       ret  = 0;
+    AVTOPSCodecDeviceContext* ctx  = device_ctx->hwctx;
+    TOPSCodecDevicePriv*      priv = device_ctx->internal->priv;
     (void)ctx;
-    (void)ret;
+
+    if (!priv->slab_size) priv->slab_size = TOPSCODEC_SLAB_SIZE;
+    if (!priv->slab_align) priv->slab_align = TOPSCODEC_SLAB_ALIGN;
+
+    ret = pthread_mutex_init(&priv->lock, NULL);
+    if (ret) return AVERROR(ret);
+    ret = pthread_mutex_init(&priv->slab_lock, NULL);
+    if (ret) goto fail_slab_lock;
+    ret = pthread_mutex_init(&priv->mem_lock, NULL);
+    if (ret) goto fail_mem_lock;
+    ret = pthread_cond_init(&priv->mem_cond, NULL);
+    if (ret) goto fail_mem_cond;
+    priv->lock_init = 1;
     av_log(NULL, AV_LOG_DEBUG, "topscodec_device_init success\n");
     return 0;
+
+fail_mem_cond:
+    pthread_mutex_destroy(&priv->mem_lock);
+fail_mem_lock:
+    pthread_mutex_destroy(&priv->slab_lock);
+fail_slab_lock:
+    pthread_mutex_destroy(&priv->lock);
+    return AVERROR(ret);
 }
 
 static void topscodec_device_uninit(AVHWDeviceContext* device_ctx) {
-    AVTOPSCodecDeviceContext* ctx = device_ctx->hwctx;
+    AVTOPSCodecDeviceContext* ctx  = device_ctx->hwctx;
+    TOPSCodecDevicePriv*      priv = device_ctx->internal->priv;
+    int                       i;
+
+    /* every frames context is gone, so every buffer is back, free them while the runtime is still loaded */
+    for (i = 0; i < priv->nb_subpools; i++) av_buffer_pool_uninit(&priv->subpools[i].pool);
+    priv->nb_subpools = 0;
+
+    av_log(device_ctx, AV_LOG_VERBOSE, "slabs: %u allocated, %u freed, peak %" PRId64 " bytes\n",
+           priv->nb_slab_allocs, priv->nb_slab_frees, priv->slab_bytes_peak);
+    if (priv->slabs)
+        av_log(device_ctx, AV_LOG_WARNING, "%d frame buffers still referenced, %" PRId64 " bytes of slabs leaked\n",
+               priv->chunks_used, priv->slab_bytes);
+    av_log(device_ctx, AV_LOG_VERBOSE, "device memory: peak %" PRId64 " bytes, budget %" PRId64 "\n", priv->mem_peak,
+           priv->mem_budget);
+    if (priv->lock_init) {
+        pthread_cond_destroy(&priv->mem_cond);
+        pthread_mutex_destroy(&priv->mem_lock);
+        pthread_mutex_destroy(&priv->slab_lock);
+        pthread_mutex_destroy(&priv->lock);
+    }
+    priv->lock_init = 0;
+
     pthread_mutex_lock(&g_hw_mutex);
     if (ctx->topsruntime_lib_ctx) {
-        topsruntimes_free_functions(&ctx->topsruntime_lib_ctx);
-        av_log(NULL, AV_LOG_DEBUG, "topsruntimes_free_functions success\n");
+        if (--g_runtime_lib_ref == 0) {
+            topsruntimes_free_functions(&g_runtime_lib);
+            av_log(NULL, AV_LOG_DEBUG, "topsruntimes_free_functions success\n");
+        }
+        ctx->topsruntime_lib_ctx = NULL;
     }
     pthread_mutex_unlock(&g_hw_mutex);
 }
@@ -262,16 +751,43 @@ static void topscodec_device_uninit(AVHWDeviceContext* device_ctx) {
 static int topscodec_device_create(AVHWDeviceContext* device_ctx, const char* device, /*device id*/
                                    AVDictionary* opts, int flags) {
     AVTOPSCodecDeviceContext* ctx        = device_ctx->hwctx;
+    TOPSCodecDevicePriv*      priv       = device_ctx->internal->priv;
+    AVDictionaryEntry*        e          = NULL;
     int                       device_idx = 0;
     int                       ret        = 0;
 
+    e = av_dict_get(opts, "slab_size", NULL, 0);
+    if (e) priv->slab_size = strtol(e->value, NULL, 0);
+    e = av_dict_get(opts, "slab_align", NULL, 0);
+    if (e) priv->slab_align = strtol(e->value, NULL, 0);
+    if (priv->slab_size < 0 || priv->slab_align < 0 || (priv->slab_align & (priv->slab_align - 1))) {
+        av_log(device_ctx, AV_LOG_ERROR, "Invalid slab_size %d or slab_align %d\n", priv->slab_size,
+               priv->slab_align);
+        return AVERROR(EINVAL);
+    }
+    e = av_dict_get(opts, "mem_budget", NULL, 0);
+    if (e) priv->mem_budget = strtoll(e->value, NULL, 0);
+    e = av_dict_get(opts, "mem_wait", NULL, 0);
+    if (e) priv->mem_wait = strtol(e->value, NULL, 0);
+    if (priv->mem_budget < 0 || priv->mem_wait < -1) {
+        av_log(device_ctx, AV_LOG_ERROR, "Invalid mem_budget %" PRId64 " or mem_wait %d\n", priv->mem_budget,
+               priv->mem_wait);
+        return AVERROR(EINVAL);
+    }
+
     pthread_mutex_lock(&g_hw_mutex);
-    ret = topsruntimes_load_functions(&ctx->topsruntime_lib_ctx);
-    if (ret != 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error, topsruntime_lib_ctx failed, ret(%d)\n", ret);
-        pthread_mutex_unlock(&g_hw_mutex);
-        return ret;
+    if (!g_runtime_lib_ref) {
+        ret = topsruntimes_load_functions(&g_runtime_lib);
+        if (ret != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error, topsruntime_lib_ctx failed, ret(%d)\n", ret);
+            pthread_mutex_unlock(&g_hw_mutex);
+            return ret;
+        }
     }
+    g_runtime_lib_ref++;
+    ctx->topsruntime_lib_ctx = g_runtime_lib;
+    /* topsSetDevice() only selects the device of the calling thread, no need to hold the lock */
+    pthread_mutex_unlock(&g_hw_mutex);
 
     // ret = ctx->topsruntime_lib_ctx->lib_topsInit(0);
     // if (ret != 0) {
@@ -289,11 +805,9 @@ static int topscodec_device_create(AVHWDeviceContext* device_ctx, const char* de
     if (ret != 0) {
         av_log(NULL, AV_LOG_ERROR, "Error, topscodec_set_device[%d] failed, ret(%d)\n", device_idx, ret);
         ret = AVERROR(EINVAL);
-        pthread_mutex_unlock(&g_hw_mutex);
         return ret;
     }
     av_log(NULL, AV_LOG_DEBUG, "topscodec_set_device[%d] success\n", device_idx);
-    pthread_mutex_unlock(&g_hw_mutex);
     return 0;
 }
 
@@ -301,9 +815,9 @@ const HWContextType ff_hwcontext_type_topscodec = {
     .type                   = AV_HWDEVICE_TYPE_TOPSCODEC,
     .name                   = "topscodec",
     .device_hwctx_size      = sizeof(AVTOPSCodecDeviceContext),
-    .device_priv_size       = 0,                       /*TODO*/
-    .frames_hwctx_size      = 0,                       /*TODO*/
-    .frames_priv_size       = 0,                       /*TODO*/
+    .device_priv_size       = sizeof(TOPSCodecDevicePriv),
+    .frames_hwctx_size      = sizeof(AVTOPSCodecFramesContext),
+    .frames_priv_size       = sizeof(TOPSCodecFramesPriv),
     .device_create          = topscodec_device_create, /*MUST NOT BE NULL*/
     .device_init            = topscodec_device_init,
     .device_uninit          = topscodec_device_uninit,
@@ -19,6 +19,8 @@
 #ifndef AVUTIL_HWCONTEXT_TOPSCODEC_H
 #define AVUTIL_HWCONTEXT_TOPSCODEC_H
 
+#include "frame.h"
+#include "hwcontext.h"
 #include "pixfmt.h"
 #include "tops/dynlink_tops_loader.h"
 
@@ -33,4 +35,95 @@ typedef struct AVTOPSCodecDeviceContext {
     void*                  reserved2[4];
 } AVTOPSCodecDeviceContext;
 
+/**
+ * This struct is allocated as AVHWFramesContext.hwctx, set it before
+ * av_hwframe_ctx_init(). AVHWFramesContext.initial_pool_size buffers are
+ * allocated by av_hwframe_ctx_init().
+ */
+typedef struct AVTOPSCodecFramesContext {
+    /**
+     * Buffers the pool allocates at most, av_hwframe_get_buffer() fails with
+     * ENOMEM while all of them are in use. 0 means no limit.
+     */
+    int max_pool_size;
+    /**
+     * Alignment of the device address of each buffer, a power of two, the
+     * buffer size is rounded up to it as well. 0 means the device default.
+     */
+    int alignment;
+    /**
+     * Flags for topsExtMallocWithFlags(), e.g. topsMallocHostAccessable.
+     * 0 allocates with topsMalloc().
+     */
+    unsigned int flags;
+} AVTOPSCodecFramesContext;
+
+/**
+ * Device memory is accounted per AVHWDeviceContext by what it is used for.
+ * A budget can be set with the "mem_budget" (bytes) option of
+ * av_hwdevice_ctx_create(), "mem_wait" is how long (ms) a reservation past
+ * the budget waits for memory to come back, 0 fails at once, -1 waits forever.
+ */
+enum AVTOPSCodecMemType {
+    AV_TOPSCODEC_MEM_FRAMES, /*!< frame pools, the targets of the D2D copies*/
+    AV_TOPSCODEC_MEM_STREAM, /*!< decoder stream buffers*/
+    AV_TOPSCODEC_MEM_NB
+};
+
+#define AV_TOPSCODEC_MEM_FORCE (1 << 0)  ///< account the memory even past the budget, never waits
+
+/**
+ * Account size bytes of type before allocating them. Over the budget, the
+ * memory the device keeps idle and what the reclaim callback frees go first,
+ * then it waits up to mem_wait. Do not call it while holding a lock that
+ * frees memory of the device.
+ *
+ * @return 0 on success, AVERROR(ENOMEM) if the budget is still exceeded after mem_wait
+ */
+int av_topscodec_mem_reserve(AVHWDeviceContext* ctx, enum AVTOPSCodecMemType type, int64_t size, int flags);
+
+/**
+ * Set the function called when a reservation is over the budget, before it
+ * waits, to free the memory of ctx its user keeps idle, e.g. pooled decoder
+ * sessions. It is called without any lock of ctx held.
+ */
+void av_topscodec_mem_set_reclaim(AVHWDeviceContext* ctx, void (*reclaim)(AVHWDeviceContext* ctx));
+
+/**
+ * Give back a reservation once the memory is freed, wakes up waiting reservations.
+ */
+void av_topscodec_mem_release(AVHWDeviceContext* ctx, enum AVTOPSCodecMemType type, int64_t size);
+
+/**
+ * Bytes in use by type, usage has AV_TOPSCODEC_MEM_NB entries.
+ */
+void av_topscodec_mem_usage(AVHWDeviceContext* ctx, int64_t* usage);
+
+/**
+ * Data of the AV_FRAME_DATA_TOPSCODEC_COMPANION side data, a downscaled copy
+ * of the frame in device memory. It is plain data, copies of the frame props
+ * copy it as is. The planes and the frames context are kept alive by
+ * AVFrame.extended_buf of the frame the decoder returned, so they are valid
+ * as long as that frame or a reference to it is held.
+ */
+typedef struct AVTOPSCodecCompanion {
+    uint8_t*           data[4];  ///< device addresses of the planes
+    int                linesize[4];
+    int                width;
+    int                height;
+    enum AVPixelFormat format;  ///< software format of the planes
+    int64_t            pts;
+    AVHWFramesContext* frames;  ///< frames context of the companion, on the device of the frame
+} AVTOPSCodecCompanion;
+
+/**
+ * Reference the companion of frame as a frame of its own, with hw_frames_ctx
+ * set so it can be downloaded with av_hwframe_transfer_data().
+ *
+ * @return 0 on success, AVERROR(ENOENT) if frame has no companion,
+ *         AVERROR(EINVAL) if frame does not hold the companion's buffers
+ *         (only its props were copied), AVERROR(ENOMEM)
+ */
+int av_topscodec_companion_frame(const AVFrame* frame, AVFrame* companion);
+
 #endif  // AVUTIL_HWCONTEXT_TOPSCODEC_H
\ No newline at end of file